@@ -0,0 +1,722 @@
+#include "Config.h"
+#include "Apu.h"
+#include "FramePacer.h"
+
+#include <string.h>
+
+// the frame sequencer clocks the length counters, sweep and envelopes at 512Hz
+#define APU_SEQUENCER_PERIOD 8192
+
+// a blip frame that gets longer than this is ended early, the blip buffers have room for this much
+#define APU_MAX_FRAME (1 << 17)
+
+// a channel at level 15 with the master volume at 8 is 7680, so all four together still fit in 16 bits
+#define APU_LEVEL_SCALE 64
+
+// registers as offsets from FF10
+#define REG_NR50 0x14
+#define REG_NR51 0x15
+#define REG_NR52 0x16
+#define REG_WAVE_RAM 0x20
+
+static const BYTE dutyTable[4][8] = {
+    { 0, 0, 0, 0, 0, 0, 0, 1 },		// 12.5%
+    { 1, 0, 0, 0, 0, 0, 0, 1 },		// 25%
+    { 1, 0, 0, 0, 0, 1, 1, 1 },		// 50%
+    { 0, 1, 1, 1, 1, 1, 1, 0 }		// 75%
+} ;
+
+static const int noiseDivisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 } ;
+
+// bits that always read back as 1, FF10 - FF2F. Frequencies and lengths are write only
+static const BYTE readMasks[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,		// NR10 - NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,		// NR20 - NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,		// NR30 - NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,		// NR40 - NR44
+    0x00, 0x00, 0x70,					// NR50 - NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+} ;
+
+// what the boot ROM leaves in FF10 - FF25, it has just played the start up sound on channel 1
+static const BYTE bootRegisters[0x16] = {
+    0x80, 0xBF, 0xF3, 0xFF, 0xBF,
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,
+    0x77, 0xF3
+} ;
+
+//////////////////////////////////////////////////////////////////
+
+Apu::Apu(void) :
+    m_Power(false)
+    ,m_SequencerStep(0)
+    ,m_NextSequencer(APU_SEQUENCER_PERIOD)
+    ,m_FrameStart(0)
+    ,m_Time(0)
+    ,m_OutputEnabled(true)
+    ,m_SampleRate(0)
+    ,m_RateAdjust(1.0)
+    ,m_AppliedRateAdjust(1.0) {
+    memset(m_Registers, 0, sizeof(m_Registers)) ;
+    ClearChannels( ) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::Reset(bool afterBootRom) {
+    PowerOff(m_Time) ;
+
+    if (afterBootRom) {
+        WriteRegister(0xFF26, 0x80, m_FrameStart + m_Time) ;
+
+        // without the trigger bits, the start up sound has finished but channel 1 is still on
+        for (int reg = 0; reg < REG_NR52; reg++) {
+            BYTE data = (reg % 5 == 4) ? bootRegisters[reg] & 0x7F : bootRegisters[reg] ;
+            m_Registers[reg] = bootRegisters[reg] ;
+            Write(reg, data, m_Time) ;
+        }
+        m_Square1.enabled = true ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+BYTE Apu::ReadRegister(WORD address, unsigned long long time) {
+    int reg = address - 0xFF10 ;
+
+    if (reg >= REG_WAVE_RAM) {
+        return m_Registers[reg] ;
+    }
+
+    // the status bits are the only thing that can change without a write
+    if (reg == REG_NR52) {
+        if (time > m_FrameStart + APU_MAX_FRAME) {
+            EndFrame(time) ;
+        }
+        Run(ToFrameTime(time)) ;
+
+        BYTE status = m_Power ? 0xF0 : 0x70 ;
+        status |= m_Square1.enabled ? 0x01 : 0 ;
+        status |= m_Square2.enabled ? 0x02 : 0 ;
+        status |= m_Wave.enabled ? 0x04 : 0 ;
+        status |= m_Noise.enabled ? 0x08 : 0 ;
+        return status ;
+    }
+
+    return m_Registers[reg] | readMasks[reg] ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::WriteRegister(WORD address, BYTE data, unsigned long long time) {
+    if (time > m_FrameStart + APU_MAX_FRAME) {
+        EndFrame(time) ;
+    }
+
+    // everything before the write happens with the old value
+    int frameTime = ToFrameTime(time) ;
+    Run(frameTime) ;
+
+    int reg = address - 0xFF10 ;
+
+    if (reg >= REG_WAVE_RAM) {
+        m_Registers[reg] = data ;
+    } else if (reg == REG_NR52) {
+        if (!TestBit(data, 7)) {
+            PowerOff(frameTime) ;
+        } else if (!m_Power) {
+            m_Power = true ;
+            m_SequencerStep = 0 ;
+        }
+    } else if (m_Power) {
+        m_Registers[reg] = data ;
+        Write(reg, data, frameTime) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::EndFrame(unsigned long long time) {
+    // a frame that has gone on too long, e.g. the debugger paused half way through it, ends in pieces
+    while (time > m_FrameStart + APU_MAX_FRAME) {
+        EndFrameAt(APU_MAX_FRAME) ;
+    }
+    EndFrameAt(ToFrameTime(time)) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// 0 turns the output off, the registers and channels still work but nothing is synthesised
+void Apu::SetSampleRate(int sampleRate) {
+    m_SampleRate = sampleRate ;
+
+    if (sampleRate > 0) {
+        for (int side = 0; side < 2; side++) {
+            m_Blip[side].SetRates(GAMEBOY_CLOCK_HZ / m_RateAdjust, sampleRate, sampleRate / 4, APU_MAX_FRAME) ;
+        }
+        m_AppliedRateAdjust = m_RateAdjust ;
+    }
+
+    // the buffers start from silence, so the channels have to step up to where they are
+    Channel* channels[4] = { &m_Square1, &m_Square2, &m_Wave, &m_Noise } ;
+    for (int i = 0; i < 4; i++) {
+        channels[i]->amplitude[0] = 0 ;
+        channels[i]->amplitude[1] = 0 ;
+        UpdateAmplitudes(*channels[i], m_Time) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+int Apu::ReadSamples(short* out, int maxSamples) {
+    int count = m_Blip[0].ReadSamples(out, maxSamples, 2) ;
+    m_Blip[1].ReadSamples(out + 1, count, 2) ;
+    return count ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::CopyState(const Apu& other) {
+    m_Square1 = other.m_Square1 ;
+    m_Square2 = other.m_Square2 ;
+    m_Wave = other.m_Wave ;
+    m_Noise = other.m_Noise ;
+
+    memcpy(m_Registers, other.m_Registers, sizeof(m_Registers)) ;
+    m_Power = other.m_Power ;
+    m_SequencerStep = other.m_SequencerStep ;
+    m_NextSequencer = other.m_NextSequencer ;
+    m_FrameStart = other.m_FrameStart ;
+    m_Time = other.m_Time ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// brings everything up to time, a cycle count from the start of the frame. The channels run up to each
+// sequencer step, so a length counter running out or an envelope step happens at the right point
+void Apu::Run(int time) {
+    while (m_NextSequencer <= time) {
+        RunSquare(m_Square1, m_NextSequencer) ;
+        RunSquare(m_Square2, m_NextSequencer) ;
+        RunWave(m_NextSequencer) ;
+        RunNoise(m_NextSequencer) ;
+
+        ClockSequencer(m_NextSequencer) ;
+        m_NextSequencer += APU_SEQUENCER_PERIOD ;
+    }
+
+    RunSquare(m_Square1, time) ;
+    RunSquare(m_Square2, time) ;
+    RunWave(time) ;
+    RunNoise(time) ;
+
+    if (time > m_Time) {
+        m_Time = time ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the duty cycle moves on one step every (2048 - frequency) * 4 cycles
+void Apu::RunSquare(Square& square, int time) {
+    if (!square.enabled) {
+        if (square.nextStep < time) {
+            square.nextStep = time ;
+        }
+        return ;
+    }
+
+    int period = (2048 - square.frequency) * 4 ;
+    int volume = square.envelope.volume ;
+
+    // silent, the level can't change so skip straight to the end
+    if (volume == 0) {
+        if (square.nextStep < time) {
+            int steps = (time - square.nextStep + period - 1) / period ;
+            square.dutyStep = (square.dutyStep + steps) & 7 ;
+            square.nextStep += steps * period ;
+        }
+        return ;
+    }
+
+    const BYTE* duty = dutyTable[square.duty] ;
+    while (square.nextStep < time) {
+        square.dutyStep = (square.dutyStep + 1) & 7 ;
+        SetOutput(square, duty[square.dutyStep] ? volume : 0, square.nextStep) ;
+        square.nextStep += period ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// 32 4 bit samples from wave RAM, one every (2048 - frequency) * 2 cycles
+void Apu::RunWave(int time) {
+    if (!m_Wave.enabled || m_Wave.volumeShift > 3) {
+        if (m_Wave.nextStep < time) {
+            if (m_Wave.enabled) {
+                int period = (2048 - m_Wave.frequency) * 2 ;
+                int steps = (time - m_Wave.nextStep + period - 1) / period ;
+                m_Wave.position = (m_Wave.position + steps) & 31 ;
+                m_Wave.nextStep += steps * period ;
+            } else {
+                m_Wave.nextStep = time ;
+            }
+        }
+        return ;
+    }
+
+    int period = (2048 - m_Wave.frequency) * 2 ;
+    while (m_Wave.nextStep < time) {
+        m_Wave.position = (m_Wave.position + 1) & 31 ;
+        SetOutput(m_Wave, WaveLevel(), m_Wave.nextStep) ;
+        m_Wave.nextStep += period ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the LFSR shifts once a period, the output is the inverse of bit 0
+void Apu::RunNoise(int time) {
+    // a clock shift of 14 or 15 stops the LFSR altogether
+    if (!m_Noise.enabled || m_Noise.period == 0) {
+        if (m_Noise.nextStep < time) {
+            m_Noise.nextStep = time ;
+        }
+        return ;
+    }
+
+    int period = m_Noise.period ;
+    int volume = m_Noise.envelope.volume ;
+
+    // silent. Where the LFSR has got to doesn't matter, it sounds the same from anywhere
+    if (volume == 0) {
+        if (m_Noise.nextStep < time) {
+            int steps = (time - m_Noise.nextStep + period - 1) / period ;
+            m_Noise.nextStep += steps * period ;
+        }
+        return ;
+    }
+
+    int lfsr = m_Noise.lfsr ;
+    while (m_Noise.nextStep < time) {
+        int bit = (lfsr ^ (lfsr >> 1)) & 1 ;
+        lfsr = (lfsr >> 1) | (bit << 14) ;
+        if (m_Noise.narrow) {
+            lfsr = (lfsr & ~0x40) | (bit << 6) ;
+        }
+
+        SetOutput(m_Noise, (lfsr & 1) ? 0 : volume, m_Noise.nextStep) ;
+        m_Noise.nextStep += period ;
+    }
+    m_Noise.lfsr = lfsr ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// length on every other step, sweep on 2 and 6, envelopes on 7
+void Apu::ClockSequencer(int time) {
+    if (!m_Power) {
+        return ;
+    }
+
+    if ((m_SequencerStep & 1) == 0) {
+        ClockLength(m_Square1, time) ;
+        ClockLength(m_Square2, time) ;
+        ClockLength(m_Wave, time) ;
+        ClockLength(m_Noise, time) ;
+    }
+
+    if (m_SequencerStep == 2 || m_SequencerStep == 6) {
+        ClockSweep(time) ;
+    }
+
+    if (m_SequencerStep == 7) {
+        if (ClockEnvelope(m_Square1.envelope)) {
+            SetOutput(m_Square1, SquareLevel(m_Square1), time) ;
+        }
+        if (ClockEnvelope(m_Square2.envelope)) {
+            SetOutput(m_Square2, SquareLevel(m_Square2), time) ;
+        }
+        if (ClockEnvelope(m_Noise.envelope)) {
+            SetOutput(m_Noise, NoiseLevel(), time) ;
+        }
+    }
+
+    m_SequencerStep = (m_SequencerStep + 1) & 7 ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::ClockLength(Channel& channel, int time) {
+    if (channel.lengthEnabled && channel.length > 0) {
+        channel.length-- ;
+        if (channel.length == 0) {
+            Disable(channel, time) ;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// returns true if the volume changed
+bool Apu::ClockEnvelope(Envelope& envelope) {
+    if (envelope.period == 0) {
+        return false ;
+    }
+
+    envelope.timer-- ;
+    if (envelope.timer > 0) {
+        return false ;
+    }
+    envelope.timer = envelope.period ;
+
+    if (envelope.increase && envelope.volume < 15) {
+        envelope.volume++ ;
+        return true ;
+    } else if (!envelope.increase && envelope.volume > 0) {
+        envelope.volume-- ;
+        return true ;
+    }
+    return false ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::ClockSweep(int time) {
+    Square& square = m_Square1 ;
+
+    square.sweepTimer-- ;
+    if (square.sweepTimer > 0) {
+        return ;
+    }
+    square.sweepTimer = square.sweepPeriod ? square.sweepPeriod : 8 ;
+
+    if (!square.sweepEnabled || square.sweepPeriod == 0) {
+        return ;
+    }
+
+    int frequency = CalculateSweep( ) ;
+    if (frequency > 2047) {
+        Disable(square, time) ;
+    } else if (square.sweepShift) {
+        square.sweepShadow = frequency ;
+        square.frequency = frequency ;
+
+        // the next step is checked straight away too
+        if (CalculateSweep( ) > 2047) {
+            Disable(square, time) ;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+int Apu::CalculateSweep( ) const {
+    int change = m_Square1.sweepShadow >> m_Square1.sweepShift ;
+    return m_Square1.sweepNegate ? m_Square1.sweepShadow - change : m_Square1.sweepShadow + change ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// reg is the offset from FF10 and the register has already been stored
+void Apu::Write(int reg, BYTE data, int time) {
+    switch (reg) {
+    // square 1 sweep
+    case 0x00:
+        m_Square1.sweepPeriod = (data >> 4) & 7 ;
+        m_Square1.sweepNegate = TestBit(data, 3) ;
+        m_Square1.sweepShift = data & 7 ;
+        break ;
+
+    // square 1 and 2
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+        WriteSquare(reg < 5 ? m_Square1 : m_Square2, reg % 5, data, time) ;
+        break ;
+
+    // wave
+    case 0x0A:
+        m_Wave.dacEnabled = TestBit(data, 7) ;
+        if (!m_Wave.dacEnabled) {
+            Disable(m_Wave, time) ;
+        }
+        break ;
+    case 0x0B:
+        m_Wave.length = 256 - data ;
+        break ;
+    case 0x0C: {
+        // 0 is muted, then full, half and quarter volume
+        static const int shifts[4] = { 4, 0, 1, 2 } ;
+        m_Wave.volumeShift = shifts[(data >> 5) & 3] ;
+        SetOutput(m_Wave, WaveLevel(), time) ;
+        break ;
+    }
+    case 0x0D:
+        m_Wave.frequency = (m_Wave.frequency & 0x700) | data ;
+        break ;
+    case 0x0E:
+        m_Wave.frequency = (m_Wave.frequency & 0xFF) | ((data & 7) << 8) ;
+        m_Wave.lengthEnabled = TestBit(data, 6) ;
+        if (TestBit(data, 7)) {
+            m_Wave.enabled = m_Wave.dacEnabled ;
+            if (m_Wave.length == 0) {
+                m_Wave.length = 256 ;
+            }
+            m_Wave.position = 0 ;
+            m_Wave.nextStep = time + (2048 - m_Wave.frequency) * 2 ;
+            SetOutput(m_Wave, WaveLevel(), time) ;
+        }
+        break ;
+
+    // noise
+    case 0x10:
+        m_Noise.length = 64 - (data & 63) ;
+        break ;
+    case 0x11:
+        WriteEnvelope(m_Noise, m_Noise.envelope, data, time) ;
+        break ;
+    case 0x12: {
+        int shift = data >> 4 ;
+        m_Noise.narrow = TestBit(data, 3) ;
+        m_Noise.period = shift < 14 ? noiseDivisors[data & 7] << shift : 0 ;
+        break ;
+    }
+    case 0x13:
+        m_Noise.lengthEnabled = TestBit(data, 6) ;
+        if (TestBit(data, 7)) {
+            m_Noise.enabled = m_Noise.dacEnabled ;
+            if (m_Noise.length == 0) {
+                m_Noise.length = 64 ;
+            }
+            m_Noise.lfsr = 0x7FFF ;
+            m_Noise.envelope.volume = m_Registers[0x11] >> 4 ;
+            m_Noise.envelope.timer = m_Noise.envelope.period ;
+            m_Noise.nextStep = time + m_Noise.period ;
+            SetOutput(m_Noise, NoiseLevel(), time) ;
+        }
+        break ;
+
+    // master volume and panning change what every channel puts out
+    case REG_NR50:
+    case REG_NR51:
+        UpdateAllAmplitudes(time) ;
+        break ;
+
+    default:
+        break ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// reg is 1 - 4, NRx1 to NRx4
+void Apu::WriteSquare(Square& square, int reg, BYTE data, int time) {
+    switch (reg) {
+    case 1:
+        square.duty = data >> 6 ;
+        square.length = 64 - (data & 63) ;
+        SetOutput(square, SquareLevel(square), time) ;
+        break ;
+    case 2:
+        WriteEnvelope(square, square.envelope, data, time) ;
+        break ;
+    case 3:
+        square.frequency = (square.frequency & 0x700) | data ;
+        break ;
+    case 4:
+        square.frequency = (square.frequency & 0xFF) | ((data & 7) << 8) ;
+        square.lengthEnabled = TestBit(data, 6) ;
+        if (TestBit(data, 7)) {
+            TriggerSquare(square, time) ;
+        }
+        break ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the top 5 bits of an envelope register also switch the channel's DAC on and off
+void Apu::WriteEnvelope(Channel& channel, Envelope& envelope, BYTE data, int time) {
+    envelope.period = data & 7 ;
+    envelope.increase = TestBit(data, 3) ;
+
+    channel.dacEnabled = (data & 0xF8) != 0 ;
+    if (!channel.dacEnabled) {
+        Disable(channel, time) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::TriggerSquare(Square& square, int time) {
+    square.enabled = square.dacEnabled ;
+    if (square.length == 0) {
+        square.length = 64 ;
+    }
+
+    square.envelope.volume = m_Registers[square.number * 5 + 2] >> 4 ;
+    square.envelope.timer = square.envelope.period ;
+    square.nextStep = time + (2048 - square.frequency) * 4 ;
+
+    if (&square == &m_Square1) {
+        square.sweepShadow = square.frequency ;
+        square.sweepTimer = square.sweepPeriod ? square.sweepPeriod : 8 ;
+        square.sweepEnabled = square.sweepPeriod != 0 || square.sweepShift != 0 ;
+        if (square.sweepShift && CalculateSweep( ) > 2047) {
+            square.enabled = false ;
+        }
+    }
+
+    SetOutput(square, SquareLevel(square), time) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+int Apu::SquareLevel(const Square& square) const {
+    return square.enabled && dutyTable[square.duty][square.dutyStep] ? square.envelope.volume : 0 ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+int Apu::WaveLevel( ) const {
+    if (!m_Wave.enabled) {
+        return 0 ;
+    }
+
+    BYTE samples = m_Registers[REG_WAVE_RAM + m_Wave.position / 2] ;
+    int sample = (m_Wave.position & 1) ? samples & 0xF : samples >> 4 ;
+    return sample >> m_Wave.volumeShift ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+int Apu::NoiseLevel( ) const {
+    return m_Noise.enabled && !(m_Noise.lfsr & 1) ? m_Noise.envelope.volume : 0 ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::SetOutput(Channel& channel, int output, int time) {
+    if (channel.output != output) {
+        channel.output = output ;
+        UpdateAmplitudes(channel, time) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// NR51 has a left and right bit for each channel, NR50 a left and right master volume of 1 - 8
+void Apu::UpdateAmplitudes(Channel& channel, int time) {
+    BYTE volumes = m_Registers[REG_NR50] ;
+    BYTE panning = m_Registers[REG_NR51] ;
+
+    int amplitude[2] ;
+    amplitude[0] = TestBit(panning, channel.number + 4) ? channel.output * (((volumes >> 4) & 7) + 1) * APU_LEVEL_SCALE : 0 ;
+    amplitude[1] = TestBit(panning, channel.number) ? channel.output * ((volumes & 7) + 1) * APU_LEVEL_SCALE : 0 ;
+
+    for (int side = 0; side < 2; side++) {
+        if (amplitude[side] != channel.amplitude[side]) {
+            if (m_SampleRate > 0 && m_OutputEnabled) {
+                m_Blip[side].AddDelta(time, amplitude[side] - channel.amplitude[side]) ;
+            }
+            channel.amplitude[side] = amplitude[side] ;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::UpdateAllAmplitudes(int time) {
+    UpdateAmplitudes(m_Square1, time) ;
+    UpdateAmplitudes(m_Square2, time) ;
+    UpdateAmplitudes(m_Wave, time) ;
+    UpdateAmplitudes(m_Noise, time) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::Disable(Channel& channel, int time) {
+    channel.enabled = false ;
+    SetOutput(channel, 0, time) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// every register but wave RAM is cleared and nothing can be written until it is switched back on
+void Apu::PowerOff(int time) {
+    Disable(m_Square1, time) ;
+    Disable(m_Square2, time) ;
+    Disable(m_Wave, time) ;
+    Disable(m_Noise, time) ;
+
+    memset(m_Registers, 0, REG_WAVE_RAM) ;
+    ClearChannels( ) ;
+    m_Power = false ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// only when every channel's output is already 0
+void Apu::ClearChannels( ) {
+    m_Square1 = Square() ;
+    m_Square2 = Square() ;
+    m_Wave = Wave() ;
+    m_Noise = Noise() ;
+
+    m_Square1.number = 0 ;
+    m_Square2.number = 1 ;
+    m_Wave.number = 2 ;
+    m_Noise.number = 3 ;
+
+    m_Wave.volumeShift = 4 ;
+    m_Noise.lfsr = 0x7FFF ;
+
+    m_Square1.nextStep = m_Time ;
+    m_Square2.nextStep = m_Time ;
+    m_Wave.nextStep = m_Time ;
+    m_Noise.nextStep = m_Time ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Apu::EndFrameAt(int time) {
+    Run(time) ;
+
+    m_Square1.nextStep -= time ;
+    m_Square2.nextStep -= time ;
+    m_Wave.nextStep -= time ;
+    m_Noise.nextStep -= time ;
+    m_NextSequencer -= time ;
+
+    m_FrameStart += time ;
+    m_Time = 0 ;
+
+    if (m_SampleRate > 0 && m_OutputEnabled) {
+        m_Blip[0].EndFrame(time) ;
+        m_Blip[1].EndFrame(time) ;
+
+        if (m_RateAdjust != m_AppliedRateAdjust) {
+            m_Blip[0].SetClockRate(GAMEBOY_CLOCK_HZ / m_RateAdjust) ;
+            m_Blip[1].SetClockRate(GAMEBOY_CLOCK_HZ / m_RateAdjust) ;
+            m_AppliedRateAdjust = m_RateAdjust ;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// times before what has already been run are treated as now
+int Apu::ToFrameTime(unsigned long long time) const {
+    if (time < m_FrameStart + m_Time) {
+        return m_Time ;
+    }
+    return (int) (time - m_FrameStart) ;
+}
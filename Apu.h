@@ -0,0 +1,156 @@
+#pragma once
+#ifndef _APU_H
+#define _APU_H
+
+#include "BlipBuffer.h"
+
+typedef unsigned char BYTE ;
+typedef unsigned short WORD ;
+
+#define APU_DEFAULT_SAMPLE_RATE 48000
+
+// the sound hardware, registers FF10 - FF3F. Nothing here runs per cycle. The channels are only brought up to
+// date when the CPU touches a register or a frame ends, and then each channel jumps straight from one step of
+// its waveform to the next. Whenever a channel's level changes the difference goes into a BlipBuffer at the
+// cycle it happened on, which turns the deltas into band-limited samples.
+//
+// All times are the emulator's total cycle count, so they never go backwards
+class Apu {
+  public:
+    Apu							(void) ;
+
+    // as the boot ROM leaves it, or everything off as at power on
+    void				Reset				( bool afterBootRom ) ;
+
+    BYTE				ReadRegister		( WORD address, unsigned long long time ) ;
+    void				WriteRegister		( WORD address, BYTE data, unsigned long long time ) ;
+
+    // run up to time and make the samples before it available
+    void				EndFrame			( unsigned long long time ) ;
+
+    void				SetSampleRate		( int sampleRate ) ;
+    int					GetSampleRate		( ) const {
+        return m_SampleRate ;
+    }
+
+    // stretches the output, 1.005 makes 0.5% more samples for the same emulated time. Takes effect from the
+    // next frame
+    void				SetRateAdjust		( double adjust ) {
+        m_RateAdjust = adjust ;
+    }
+
+    int					GetSamplesAvailable	( ) const {
+        return m_Blip[0].GetSamplesAvailable() ;
+    }
+
+    // interleaved left and right, returns how many pairs were written
+    int					ReadSamples			( short* out, int maxSamples ) ;
+
+    // while off the channels run as normal but the sound they make is thrown away, and the samples already
+    // made are left alone. For running ahead, where the state is put back afterwards
+    void				SetOutputEnabled	( bool enabled ) {
+        m_OutputEnabled = enabled ;
+    }
+
+    // everything but the output and its settings, for snapshots of the emulator
+    void				CopyState			( const Apu& other ) ;
+
+  private:
+    // what every channel has. Times are cycles from the start of the frame
+    struct Channel {
+        int		number ;			// 0 - 3, for the panning bits
+        bool	enabled ;
+        bool	dacEnabled ;
+        bool	lengthEnabled ;
+        int		length ;
+        int		frequency ;
+        int		nextStep ;			// when the waveform next moves on
+        int		output ;			// the digital level 0 - 15
+        int		amplitude[2] ;		// what is in the blip buffers for the left and right
+    };
+
+    struct Envelope {
+        int		volume ;
+        int		period ;
+        int		timer ;
+        bool	increase ;
+    };
+
+    struct Square : Channel {
+        Envelope envelope ;
+        int		duty ;
+        int		dutyStep ;
+
+        // channel 1 only
+        int		sweepPeriod ;
+        int		sweepTimer ;
+        int		sweepShift ;
+        bool	sweepNegate ;
+        bool	sweepEnabled ;
+        int		sweepShadow ;
+    };
+
+    struct Wave : Channel {
+        int		position ;
+        int		volumeShift ;
+    };
+
+    struct Noise : Channel {
+        Envelope envelope ;
+        int		period ;
+        bool	narrow ;			// 7 bit LFSR instead of 15
+        int		lfsr ;
+    };
+
+    void				Run					( int time ) ;
+    void				RunSquare			( Square& square, int time ) ;
+    void				RunWave				( int time ) ;
+    void				RunNoise			( int time ) ;
+
+    void				ClockSequencer		( int time ) ;
+    void				ClockLength			( Channel& channel, int time ) ;
+    bool				ClockEnvelope		( Envelope& envelope ) ;
+    void				ClockSweep			( int time ) ;
+    int					CalculateSweep		( ) const ;
+
+    void				Write				( int reg, BYTE data, int time ) ;
+    void				WriteSquare			( Square& square, int reg, BYTE data, int time ) ;
+    void				WriteEnvelope		( Channel& channel, Envelope& envelope, BYTE data, int time ) ;
+    void				TriggerSquare		( Square& square, int time ) ;
+
+    int					SquareLevel			( const Square& square ) const ;
+    int					WaveLevel			( ) const ;
+    int					NoiseLevel			( ) const ;
+
+    void				SetOutput			( Channel& channel, int output, int time ) ;
+    void				UpdateAmplitudes	( Channel& channel, int time ) ;
+    void				UpdateAllAmplitudes	( int time ) ;
+    void				Disable				( Channel& channel, int time ) ;
+    void				PowerOff			( int time ) ;
+    void				ClearChannels		( ) ;
+
+    void				EndFrameAt			( int time ) ;
+    int					ToFrameTime			( unsigned long long time ) const ;
+
+    Square				m_Square1 ;
+    Square				m_Square2 ;
+    Wave				m_Wave ;
+    Noise				m_Noise ;
+
+    BYTE				m_Registers[0x30] ;		// FF10 - FF3F as written, wave RAM at the end
+    bool				m_Power ;
+
+    int					m_SequencerStep ;
+    int					m_NextSequencer ;		// frame time of the next sequencer step
+
+    unsigned long long	m_FrameStart ;			// total cycles when the current blip frame started
+    int					m_Time ;				// how far the channels have run, cycles from m_FrameStart
+
+    bool				m_OutputEnabled ;
+    int					m_SampleRate ;
+    double				m_RateAdjust ;
+    double				m_AppliedRateAdjust ;	// what the blip buffers are using
+    BlipBuffer			m_Blip[2] ;				// left and right
+};
+
+#endif
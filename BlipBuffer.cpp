@@ -0,0 +1,140 @@
+#include "Config.h"
+#include "BlipBuffer.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+// the kernel is a windowed sinc that passes up to this fraction of the output's nyquist frequency
+#define BLIP_CUTOFF 0.9
+
+// deltas are scaled by this so the kernel's taps keep some precision
+#define BLIP_DELTA_BITS 15
+
+// the integrator leaks a little every sample, which removes any DC offset. Higher is a lower cutoff, 9 is
+// about 15Hz at 48kHz
+#define BLIP_BASS_SHIFT 9
+
+//////////////////////////////////////////////////////////////////
+
+BlipBuffer::BlipBuffer(void) :
+    m_Factor(0)
+    ,m_Offset(0)
+    ,m_SampleRate(0)
+    ,m_MaxSamples(0)
+    ,m_Integrator(0) {
+    const double pi = 3.14159265358979323846 ;
+
+    // each phase is the impulse for a step that falls that far between two samples, centred BLIP_WIDTH / 2
+    // samples later so all of it comes after the step
+    for (int phase = 0; phase < BLIP_PHASES; phase++) {
+        double taps[BLIP_WIDTH] ;
+        double total = 0 ;
+
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            double x = i - BLIP_WIDTH / 2 - (double) phase / BLIP_PHASES ;
+            double sinc = x == 0 ? 1.0 : sin(pi * BLIP_CUTOFF * x) / (pi * BLIP_CUTOFF * x) ;
+            double window = fabs(x) >= BLIP_WIDTH / 2 ? 0.0 :
+                            0.42 + 0.5 * cos(pi * x / (BLIP_WIDTH / 2)) + 0.08 * cos(2 * pi * x / (BLIP_WIDTH / 2)) ;
+            taps[i] = sinc * window ;
+            total += taps[i] ;
+        }
+
+        // every phase has to add up to exactly one step, or a square wave would creep up or down
+        int sum = 0 ;
+        int largest = 0 ;
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            m_Kernel[phase][i] = (short) floor(taps[i] / total * (1 << BLIP_DELTA_BITS) + 0.5) ;
+            sum += m_Kernel[phase][i] ;
+            if (m_Kernel[phase][i] > m_Kernel[phase][largest]) {
+                largest = i ;
+            }
+        }
+        m_Kernel[phase][largest] += (1 << BLIP_DELTA_BITS) - sum ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// maxFrameClocks is the longest frame EndFrame will be given
+void BlipBuffer::SetRates(double clockRate, int sampleRate, int maxSamples, int maxFrameClocks) {
+    m_SampleRate = sampleRate ;
+    m_MaxSamples = maxSamples ;
+    SetClockRate(clockRate) ;
+
+    // with some room for the clock rate to be adjusted a little
+    int frameSamples = (int) (((unsigned long long) maxFrameClocks * m_Factor) >> 32) ;
+    frameSamples += frameSamples / 32 + 1 ;
+
+    m_Buffer.assign(maxSamples + frameSamples + BLIP_WIDTH, 0) ;
+    Clear() ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void BlipBuffer::SetClockRate(double clockRate) {
+    m_Factor = (unsigned long long) ((double) m_SampleRate / clockRate * 4294967296.0 + 0.5) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void BlipBuffer::Clear( ) {
+    m_Offset = 0 ;
+    m_Integrator = 0 ;
+    std::fill(m_Buffer.begin(), m_Buffer.end(), 0) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void BlipBuffer::EndFrame(unsigned int duration) {
+    m_Offset += duration * m_Factor ;
+
+    // nobody is reading, keep the newest
+    int excess = GetSamplesAvailable() - m_MaxSamples ;
+    if (excess > 0) {
+        ReadSamples(NULL, excess, 1) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// out can be NULL to throw the samples away, they still go through the integrator so what comes after is right
+int BlipBuffer::ReadSamples(short* out, int count, int stride) {
+    int available = GetSamplesAvailable() ;
+    if (count > available) {
+        count = available ;
+    }
+
+    int sum = m_Integrator ;
+    for (int i = 0; i < count; i++) {
+        sum += m_Buffer[i] ;
+
+        int sample = sum >> BLIP_DELTA_BITS ;
+        if (sample > 32767) {
+            sample = 32767 ;
+        } else if (sample < -32768) {
+            sample = -32768 ;
+        }
+
+        if (out) {
+            out[i * stride] = (short) sample ;
+        }
+        sum -= sample * (1 << (BLIP_DELTA_BITS - BLIP_BASS_SHIFT)) ;
+    }
+    m_Integrator = sum ;
+
+    RemoveSamples(count) ;
+    return count ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void BlipBuffer::RemoveSamples(int count) {
+    // between frames nothing has been added past the tails of the last frame's deltas
+    int remaining = GetSamplesAvailable() - count + BLIP_WIDTH ;
+
+    memmove(&m_Buffer[0], &m_Buffer[count], remaining * sizeof(int)) ;
+    memset(&m_Buffer[remaining], 0, count * sizeof(int)) ;
+
+    m_Offset -= (unsigned long long) count << 32 ;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef _BLIPBUFFER_H
+#define _BLIPBUFFER_H
+
+#include <vector>
+
+// sub-sample positions a delta can be placed at, and how many output samples each delta's step is spread over
+#define BLIP_PHASE_BITS 6
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_WIDTH 16
+
+// band-limited step synthesis. Instead of producing a sample for every clock, the sound chip tells the
+// buffer when its output steps up or down and by how much, and the buffer adds a band-limited step at that
+// point. A square wave at 1kHz then costs 2000 deltas a second whatever the clock rate is, and there is no
+// aliasing to filter out afterwards.
+//
+// Times are in clocks from the start of the current frame. EndFrame moves the start of the frame on and makes
+// the samples before it available to read
+class BlipBuffer {
+  public:
+    BlipBuffer					(void) ;
+
+    // maxSamples is how many samples can be waiting to be read, any more and the oldest are dropped
+    void				SetRates			( double clockRate, int sampleRate, int maxSamples, int maxFrameClocks ) ;
+    void				Clear				( ) ;
+
+    // changes the rate without losing what is buffered, only between frames
+    void				SetClockRate		( double clockRate ) ;
+
+    // delta is in 16 bit sample units
+    void				AddDelta			( unsigned int time, int delta ) {
+        unsigned long long position = m_Offset + time * m_Factor ;
+        const short* kernel = m_Kernel[(position >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)] ;
+        int* out = &m_Buffer[position >> 32] ;
+
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            out[i] += kernel[i] * delta ;
+        }
+    }
+
+    void				EndFrame			( unsigned int duration ) ;
+
+    int					GetSamplesAvailable	( ) const {
+        return (int) (m_Offset >> 32) ;
+    }
+
+    // writes up to count samples to out, stride samples apart, and returns how many it wrote. Only between
+    // frames, not once deltas for the next frame have been added
+    int					ReadSamples			( short* out, int count, int stride ) ;
+
+  private:
+    void				RemoveSamples		( int count ) ;
+
+    unsigned long long	m_Factor ;			// output samples per clock, 32.32 fixed point
+    unsigned long long	m_Offset ;			// where the frame starts in the buffer, 32.32 fixed point
+    int					m_SampleRate ;
+    int					m_MaxSamples ;
+    int					m_Integrator ;		// running sum that turns the deltas back into a waveform
+    std::vector<int>	m_Buffer ;
+    short				m_Kernel[BLIP_PHASES][BLIP_WIDTH] ;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "Config.h"
+#include "Emulator.h"
+
+#include <chrono>
+#include <string.h>
+
+// how many times the render thread yields on an empty queue before it starts sleeping
+#define RENDER_IDLE_SPINS 2000
+#define RENDER_IDLE_SLEEP_MICROSECONDS 100
+
+//////////////////////////////////////////////////////////////////
+
+// with the render thread enabled the emulation thread never draws anything. At the start of each line it
+// pushes a snapshot of the LCD registers, every VRAM and OAM write is pushed as it happens and V-Blank
+// pushes a publish. The render thread replays all of that in order against its own copy of VRAM and OAM
+// so each line comes out exactly as the catch up renderer would have drawn it
+void Emulator::SetRenderThread(bool enabled) {
+    if (enabled == (m_RenderThread != NULL)) {
+        return;
+    }
+
+    if (enabled) {
+        // lines the catch up renderer still owes are drawn now, from here on the mirror is used
+        DrawPendingLines();
+        SyncVideoMirror();
+        m_RenderThread = new std::thread(&Emulator::RenderThreadMain, this);
+    } else {
+        RenderCommand command;
+        command.type = RENDER_QUIT;
+        PushRenderCommand(command);
+
+        m_RenderThread->join();
+        delete m_RenderThread;
+        m_RenderThread = NULL;
+
+        // the cache was drawn from the mirror, from now on m_Rom is drawn from
+        InvalidateBackgroundCache();
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Emulator::RenderThreadMain( ) {
+    RenderCommand command;
+    int idleSpins = 0;
+
+    while (true) {
+        if (!m_RenderQueue.Pop(command)) {
+            // the next line is usually only a few microseconds away so spin for a while, but back off if
+            // the emulator is paused or skipping frames so an idle render thread doesnt eat a whole core
+            if (idleSpins < RENDER_IDLE_SPINS) {
+                idleSpins++;
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(RENDER_IDLE_SLEEP_MICROSECONDS));
+            }
+            continue;
+        }
+
+        idleSpins = 0;
+
+        switch (command.type) {
+        case RENDER_DRAW_LINE:
+            DrawScanLine(command.registers, m_VideoMirror, m_VideoMirror + 0x2000);
+            break;
+        case RENDER_WRITE_VIDEO:
+            m_VideoMirror[command.address] = command.data;
+            if (command.address < 0x1800) {
+                m_TileVersion[command.address >> 4]++;
+            }
+            break;
+        case RENDER_PUBLISH_FRAME:
+            m_FrameBuffer.Publish();
+            break;
+        case RENDER_QUIT:
+            m_RenderCommandsDone.fetch_add(1, std::memory_order_release);
+            return;
+        default:
+            assert(false);
+            break;
+        }
+
+        m_RenderCommandsDone.fetch_add(1, std::memory_order_release);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Emulator::PushRenderCommand(const RenderCommand& command) {
+    // the render thread has fallen a whole queue behind, wait for it rather than lose a command
+    while (!m_RenderQueue.Push(command)) {
+        std::this_thread::yield();
+    }
+
+    m_RenderCommandsPushed++;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// called after every write to VRAM (0x8000-0x9FFF) or OAM (0xFE00-0xFE9F) while the render thread is running
+void Emulator::MirrorVideoWrite(WORD address, BYTE data) {
+    // nothing is drawn this frame so dont bother the render thread, the whole mirror is copied again
+    // before the next frame that is drawn
+    if (!m_RenderThisFrame) {
+        m_VideoMirrorStale = true;
+        return;
+    }
+
+    RenderCommand command;
+    command.type = RENDER_WRITE_VIDEO;
+    command.address = address >= 0xFE00 ? 0x2000 + (address - 0xFE00) : address - 0x8000;
+    command.data = data;
+    PushRenderCommand(command);
+}
+
+//////////////////////////////////////////////////////////////////
+
+// only safe while the render thread is idle (or not running). The background cache keeps every tile that
+// is the same in the mirror already, which is most of them
+void Emulator::SyncVideoMirror( ) {
+    InvalidateChangedTiles(m_VideoMirror, &m_Rom[0x8000]);
+
+    memcpy(m_VideoMirror, &m_Rom[0x8000], 0x2000);
+    memcpy(m_VideoMirror + 0x2000, &m_Rom[0xFE00], 0xA0);
+    m_VideoMirrorStale = false;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// waits until the render thread has carried out the given number of commands
+void Emulator::WaitForRenderThread(unsigned long long command) {
+    while (m_RenderCommandsDone.load(std::memory_order_acquire) < command) {
+        std::this_thread::yield();
+    }
+}
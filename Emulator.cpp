@@ -2,23 +2,31 @@
 #include "Emulator.h"
 
 #include <algorithm>
+#include <limits.h>
+#include <string.h>
 
 #define VERTICAL_BLANK_SCAN_LINE 0x90
 #define VERTICAL_BLANK_SCAN_LINE_MAX 0x99
 #define RETRACE_START 456
+#define OAM_SEARCH_CYCLES 80
+#define PIXEL_TRANSFER_CYCLES 172
+#define HBLANK_CYCLES 204
+#define BACKGROUND_CELL_INVALID 0xFFFF
 
 //////////////////////////////////////////////////////////////////
 
 Emulator::Emulator(bool enableBootROM) :
     m_GameLoaded(false)
     ,m_CyclesThisUpdate(0)
+    ,m_CyclesBeforeUpdate(0)
     ,m_UsingMBC1(false)
     ,m_EnableRamBank(false)
     ,m_UsingMemoryModel16_8(true)
     ,m_EnableInterupts(false)
     ,m_PendingInteruptDisabled(false)
     ,m_PendingInteruptEnabled(false)
-    ,m_RetraceLY(RETRACE_START)
+    ,m_ModeCycles(OAM_SEARCH_CYCLES)
+    ,m_LCDMode(1)
     ,m_JoypadState(0)
     ,m_Halted(false)
     ,m_TimerVariable(0)
@@ -30,13 +38,33 @@ Emulator::Emulator(bool enableBootROM) :
     ,m_TimeToPause(NULL)
     ,m_TotalOpcodes(0)
     ,m_DoLogging(false)
-    ,m_BootROMEnabled(enableBootROM) {
+    ,m_BootROMEnabled(enableBootROM)
+    ,m_RenderFunc(NULL)
+    ,m_FramesRendered(1)
+    ,m_FramePeriod(1)
+    ,m_FrameSkipCounter(0)
+    ,m_RenderThisFrame(true)
+    ,m_Headless(false)
+    ,m_FrameRendered(false)
+    ,m_WindowLine(0)
+    ,m_PendingFirstLine(-1)
+    ,m_PendingLastLine(-1)
+    ,m_RenderThread(NULL)
+    ,m_RenderCommandsPushed(0)
+    ,m_RenderCommandsDone(0)
+    ,m_PublishCommand(0)
+    ,m_VideoMirrorStale(false)
+    ,m_RunAhead(0)
+    ,m_RunAheadState(NULL) {
     ResetScreen( );
 }
 
 //////////////////////////////////////////////////////////////////
 
 Emulator::~Emulator(void) {
+    SetRenderThread(false) ;
+    delete m_RunAheadState ;
+
     for (std::vector<BYTE*>::iterator it = m_RamBank.begin(); it != m_RamBank.end(); it++)
         delete[] (*it) ;
 }
@@ -54,6 +82,12 @@ bool Emulator::LoadRom(const std::string& romName) {
 
     FILE *in;
     in = fopen( romName.c_str(), "rb" );
+    if (in == NULL) {
+        std::string message = "Could not open the ROM " + romName ;
+        LogMessage::GetSingleton()->DoLogMessage(message.c_str(), false) ;
+        m_GameLoaded = false ;
+        return false ;
+    }
     fread(m_GameBank, 1, 0x200000, in);
     fclose(in);
 
@@ -64,6 +98,8 @@ bool Emulator::LoadRom(const std::string& romName) {
 
     if (m_BootROMEnabled) {
         m_BootMode = true;
+        m_Apu.Reset(false);
+        ResetScreen();
     } else {
         m_BootMode = false;
         ResetCPU();
@@ -80,9 +116,42 @@ void Emulator::SetRenderFunc(RenderFunc func) {
 
 //////////////////////////////////////////////////////////////////
 
+// render framesRendered out of every framePeriod frames, spread as evenly as possible. The PPU keeps running
+// for the skipped frames (LY, STAT and interrupts are unchanged), only the scanline drawing is skipped
+void Emulator::SetFrameSkip(int framesRendered, int framePeriod) {
+    assert(framePeriod > 0 && framesRendered > 0 && framesRendered <= framePeriod);
+
+    m_FramesRendered = framesRendered;
+    m_FramePeriod = framePeriod;
+    m_FrameSkipCounter = 0;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// a headless emulator never fetches tiles or writes to the framebuffer, it only keeps LY, STAT and the LCD
+// interrupts running. Turning headless on takes effect immediately, turning it off waits for the next
+// frame so a half drawn frame is never reported as rendered
+void Emulator::SetHeadless(bool headless) {
+    m_Headless = headless;
+
+    if (headless) {
+        m_RenderThisFrame = false;
+        m_PendingFirstLine = -1;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
 void Emulator::ResetScreen( ) {
-    m_ScreenData.resize(160 * 144 * 4);
-    std::fill(m_ScreenData.begin(), m_ScreenData.end(), 0);
+    // the render thread owns the framebuffer until it has run out of commands
+    if (m_RenderThread) {
+        WaitForRenderThread(m_RenderCommandsPushed);
+        SyncVideoMirror();
+    }
+
+    InvalidateBackgroundCache( );
+    m_FrameBuffer.Clear( );
+    m_PendingFirstLine = -1;
 }
 
 //////////////////////////////////////////////////////////////////
@@ -96,6 +165,8 @@ bool Emulator::ResetCPU( ) {
     m_Halted = false ;
     m_TotalOpcodes = 0 ;
     m_JoypadState = 0xFF ;
+    m_InputQueue.clear() ;
+    m_CyclesBeforeUpdate += m_CyclesThisUpdate ;
     m_CyclesThisUpdate = 0 ;
     m_ProgramCounter = 0x100 ;
     m_RegisterAF.hi = 0x1;
@@ -109,24 +180,7 @@ bool Emulator::ResetCPU( ) {
     m_Rom[0xFF05] = 0x00   ;
     m_Rom[0xFF06] = 0x00   ;
     m_Rom[0xFF07] = 0x00   ;
-    m_Rom[0xFF10] = 0x80   ;
-    m_Rom[0xFF11] = 0xBF   ;
-    m_Rom[0xFF12] = 0xF3   ;
-    m_Rom[0xFF14] = 0xBF   ;
-    m_Rom[0xFF16] = 0x3F   ;
-    m_Rom[0xFF17] = 0x00   ;
-    m_Rom[0xFF19] = 0xBF   ;
-    m_Rom[0xFF1A] = 0x7F   ;
-    m_Rom[0xFF1B] = 0xFF   ;
-    m_Rom[0xFF1C] = 0x9F   ;
-    m_Rom[0xFF1E] = 0xBF   ;
-    m_Rom[0xFF20] = 0xFF   ;
-    m_Rom[0xFF21] = 0x00   ;
-    m_Rom[0xFF22] = 0x00   ;
-    m_Rom[0xFF23] = 0xBF   ;
-    m_Rom[0xFF24] = 0x77   ;
-    m_Rom[0xFF25] = 0xF3   ;
-    m_Rom[0xFF26] = 0xF1	;
+    m_Apu.Reset(true) ;	// FF10 - FF26 as the boot ROM leaves them
     m_Rom[0xFF40] = 0x91   ;
     m_Rom[0xFF42] = 0x00   ;
     m_Rom[0xFF43] = 0x00   ;
@@ -137,7 +191,7 @@ bool Emulator::ResetCPU( ) {
     m_Rom[0xFF4A] = 0x00   ;
     m_Rom[0xFF4B] = 0x00   ;
     m_Rom[0xFFFF] = 0x00   ;
-    m_RetraceLY = RETRACE_START ;
+    StartLCD( ) ;
 
     m_DebugValue = m_Rom[0x40] ;
 
@@ -198,20 +252,91 @@ static long long counter9 = 0 ;
 
 // remember this update function is not the same as the virtual update function. This gets specifically
 // called by the Game::Update function. This way I have control over when to execute the next opcode. Mainly for the debug window
-void Emulator::Update( ) {
+// returns true if a frame finished during this update and it was rendered (see SetFrameSkip)
+bool Emulator::Update( ) {
+    // the debugger wants to stop at an exact point, which running ahead would go past
+    if (m_RunAhead > 0 && !m_DebugPause && !m_DebugPausePending) {
+        return UpdateRunAhead( ) ;
+    }
+    return RunFrame( ) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// runs the next frame for real without drawing it, then m_RunAhead more from there with the input as it is now.
+// Only the last of those is drawn, then everything goes back to the end of the real frame. What is on screen is
+// then m_RunAhead frames ahead of the game, which hides that much of the game's own input lag, and it is only
+// wrong for the frames when the input changes
+bool Emulator::UpdateRunAhead( ) {
+    // the rest of the frame on screen has already been drawn ahead of time, the start of the next one is needed
+    SkipCurrentFrame( ) ;
+    RunFrame( ) ;
+    SaveState(*m_RunAheadState) ;
+
+    // the frames run ahead see the input that is queued for them, and it is still queued afterwards
+    std::deque<QueuedInput> queuedInput(m_InputQueue) ;
+
+    // the frame that is drawn starts in the one before it
+    m_Apu.SetOutputEnabled(false) ;
+    bool rendered = false ;
+    for (int i = 0; i < m_RunAhead; i++) {
+        if (i < m_RunAhead - 1) {
+            SkipCurrentFrame( ) ;
+        }
+        rendered = RunFrame( ) ;
+    }
+    m_Apu.SetOutputEnabled(true) ;
+
+    LoadState(*m_RunAheadState) ;
+    m_InputQueue.swap(queuedInput) ;
+    return rendered ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// nothing more of the frame being drawn is drawn or published, the next one is drawn as normal
+void Emulator::SkipCurrentFrame( ) {
+    m_RenderThisFrame = false ;
+    m_PendingFirstLine = -1 ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Emulator::SetRunAhead(int frames) {
+    assert(frames >= 0 && frames <= 3) ;
+
+    if (frames > 0 && m_RunAheadState == NULL) {
+        m_RunAheadState = new State ;
+    }
+    m_RunAhead = frames ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+bool Emulator::RunFrame( ) {
     hack++ ;
 
+    m_CyclesBeforeUpdate += m_CyclesThisUpdate ;
     m_CyclesThisUpdate = 0 ;
+    m_FrameRendered = false ;
+
     const int m_TargetCycles = 70221 ;
 
+    // checking one number per instruction is all queued input costs
+    int nextInput = GetNextInputTime() ;
+    if (nextInput == 0) {
+        ApplyQueuedInput() ;
+        nextInput = GetNextInputTime() ;
+    }
+
     while ((m_CyclesThisUpdate < m_TargetCycles)) { //||(ReadMemory(0xFF44) < 144))
         if (m_DebugPause)
-            return ;
+            return false ;
         if (m_DebugPausePending) {
             if ( m_TimeToPause && (m_TimeToPause() == true)) {
                 m_DebugPausePending = false ;
                 m_DebugPause = true ;
-                return ;
+                return false ;
             }
         }
 
@@ -221,29 +346,59 @@ void Emulator::Update( ) {
 
         DoTimers(cycles);
         DoGraphics(cycles);
+
+        // before the interrupts so a joypad interrupt is taken straight away
+        if (m_CyclesThisUpdate >= nextInput) {
+            ApplyQueuedInput() ;
+            nextInput = GetNextInputTime() ;
+        }
+
         DoInterupts();
     }
 
     counter9 += m_CyclesThisUpdate ;
-    m_RenderFunc() ;
+
+    m_Apu.EndFrame(GetTotalCycles()) ;
+
+    // the render thread may still be drawing the last lines, dont report the frame until it is published
+    if (m_FrameRendered && m_RenderThread) {
+        WaitForRenderThread(m_PublishCommand) ;
+    }
+
+    if (m_FrameRendered && m_RenderFunc) {
+        m_RenderFunc() ;
+    }
+
+    return m_FrameRendered ;
 }
 
 //////////////////////////////////////////////////////////////////
 
+// the LCD is a state machine that only does any work when the current mode runs out of cycles. Each visible
+// line goes through mode 2 (OAM search), mode 3 (pixel transfer) and mode 0 (H-Blank), then 10 lines of
+// mode 1 (V-Blank) follow. STAT is built from m_LCDMode when the CPU reads it (see GetLCDStatus)
 void Emulator::DoGraphics(int cycles) {
-    SetLCDStatus();
-
     // is LCD enabled?
-    if (TestBit(ReadMemory(0xFF40), 7)) {
-        m_RetraceLY -= cycles; // keep track of cycles accumulated
+    if (!TestBit(m_Rom[0xFF40], 7)) {
+        return;
     }
 
-    if (m_Rom[0xFF44] > VERTICAL_BLANK_SCAN_LINE_MAX) {
-        m_Rom[0xFF44] = 0; // reset
-    }
+    m_ModeCycles -= cycles;
 
-    if (m_RetraceLY <= 0) {
-        DrawCurrentLine();
+    while (m_ModeCycles <= 0) {
+        switch (m_LCDMode) {
+        case 2:
+            SetLCDMode(3);
+            m_ModeCycles += PIXEL_TRANSFER_CYCLES;
+            break;
+        case 3:
+            SetLCDMode(0);
+            m_ModeCycles += HBLANK_CYCLES;
+            break;
+        default:
+            DrawCurrentLine();
+            break;
+        }
     }
 }
 
@@ -305,6 +460,114 @@ void Emulator::StopGame( ) {
 
 //////////////////////////////////////////////////////////////////
 
+unsigned long long Emulator::GetStateHash( ) const {
+    WORD registers[6] = { m_RegisterAF.reg, m_RegisterBC.reg, m_RegisterDE.reg, m_RegisterHL.reg,
+                          m_StackPointer.reg, m_ProgramCounter
+                        } ;
+    int banks[2] = { m_CurrentRomBank, m_CurrentRamBank } ;
+
+    unsigned long long hash = HashBytes((const BYTE*) registers, sizeof(registers), 0) ;
+    hash = HashBytes((const BYTE*) banks, sizeof(banks), hash) ;
+    hash = HashBytes(&m_Rom[0x8000], 0x8000, hash) ;
+
+    for (std::vector<BYTE*>::const_iterator it = m_RamBank.begin(); it != m_RamBank.end(); it++)
+        hash = HashBytes(*it, 0x2000, hash) ;
+
+    return hash ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Emulator::SaveState(State& state) const {
+    memcpy(state.memory, &m_Rom[0x8000], sizeof(state.memory)) ;
+    for (int bank = 0; bank < 4; bank++) {
+        memcpy(state.ramBanks[bank], m_RamBank[bank], 0x2000) ;
+    }
+
+    state.registers[0] = m_RegisterAF.reg ;
+    state.registers[1] = m_RegisterBC.reg ;
+    state.registers[2] = m_RegisterDE.reg ;
+    state.registers[3] = m_RegisterHL.reg ;
+    state.registers[4] = m_StackPointer.reg ;
+    state.registers[5] = m_ProgramCounter ;
+
+    state.cyclesThisUpdate = m_CyclesThisUpdate ;
+    state.cyclesBeforeUpdate = m_CyclesBeforeUpdate ;
+    state.totalOpcodes = m_TotalOpcodes ;
+    state.currentRomBank = m_CurrentRomBank ;
+    state.currentRamBank = m_CurrentRamBank ;
+    state.enableRamBank = m_EnableRamBank ;
+    state.usingMemoryModel16_8 = m_UsingMemoryModel16_8 ;
+    state.enableInterupts = m_EnableInterupts ;
+    state.pendingInteruptDisabled = m_PendingInteruptDisabled ;
+    state.pendingInteruptEnabled = m_PendingInteruptEnabled ;
+    state.halted = m_Halted ;
+    state.bootMode = m_BootMode ;
+    state.modeCycles = m_ModeCycles ;
+    state.lcdMode = m_LCDMode ;
+    state.joypadState = m_JoypadState ;
+    state.timerVariable = m_TimerVariable ;
+    state.dividerVariable = m_DividerVariable ;
+    state.currentClockSpeed = m_CurrentClockSpeed ;
+    state.frameSkipCounter = m_FrameSkipCounter ;
+    state.renderThisFrame = m_RenderThisFrame ;
+    state.apu.CopyState(m_Apu) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the renderer's caches stay valid for every tile the snapshot doesn't change, so going back a frame or two
+// costs little more than the copy
+void Emulator::LoadState(const State& state) {
+    // nothing still to be drawn can come from the video memory that is about to go
+    if (m_RenderThread) {
+        WaitForRenderThread(m_RenderCommandsPushed) ;
+    } else {
+        InvalidateChangedTiles(&m_Rom[0x8000], state.memory) ;
+    }
+    m_PendingFirstLine = -1 ;
+
+    memcpy(&m_Rom[0x8000], state.memory, sizeof(state.memory)) ;
+    for (int bank = 0; bank < 4; bank++) {
+        memcpy(m_RamBank[bank], state.ramBanks[bank], 0x2000) ;
+    }
+
+    m_RegisterAF.reg = state.registers[0] ;
+    m_RegisterBC.reg = state.registers[1] ;
+    m_RegisterDE.reg = state.registers[2] ;
+    m_RegisterHL.reg = state.registers[3] ;
+    m_StackPointer.reg = state.registers[4] ;
+    m_ProgramCounter = state.registers[5] ;
+
+    m_CyclesThisUpdate = state.cyclesThisUpdate ;
+    m_CyclesBeforeUpdate = state.cyclesBeforeUpdate ;
+    m_TotalOpcodes = state.totalOpcodes ;
+    m_CurrentRomBank = state.currentRomBank ;
+    m_CurrentRamBank = state.currentRamBank ;
+    m_EnableRamBank = state.enableRamBank ;
+    m_UsingMemoryModel16_8 = state.usingMemoryModel16_8 ;
+    m_EnableInterupts = state.enableInterupts ;
+    m_PendingInteruptDisabled = state.pendingInteruptDisabled ;
+    m_PendingInteruptEnabled = state.pendingInteruptEnabled ;
+    m_Halted = state.halted ;
+    m_BootMode = state.bootMode ;
+    m_ModeCycles = state.modeCycles ;
+    m_LCDMode = state.lcdMode ;
+    m_JoypadState = state.joypadState ;
+    m_TimerVariable = state.timerVariable ;
+    m_DividerVariable = state.dividerVariable ;
+    m_CurrentClockSpeed = state.currentClockSpeed ;
+    m_FrameSkipCounter = state.frameSkipCounter ;
+    m_RenderThisFrame = state.renderThisFrame ;
+    m_Apu.CopyState(state.apu) ;
+
+    if (m_RenderThread && !m_VideoMirrorStale) {
+        SyncVideoMirror( ) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
 std::string Emulator::GetCurrentOpcode( ) const {
     return std::string("%x", m_Rom[m_ProgramCounter]) ;
 }
@@ -346,6 +609,12 @@ BYTE Emulator::ReadMemory(WORD memory)const {
     else if (memory == 0xFF00)
         return GetJoypadState( );
 
+    else if (memory == 0xFF41)
+        return GetLCDStatus( );
+
+    else if (memory >= 0xFF10 && memory <= 0xFF3F)
+        return m_Apu.ReadRegister(memory, GetTotalCycles()) ;
+
     return m_Rom[memory];
 }
 
@@ -371,6 +640,11 @@ WORD Emulator::ReadLSWord( ) const {
 
 // writes a byte to memory. Remember that address 0 - 07FFF is rom so we cant write to this address
 void Emulator::WriteByte(WORD address, BYTE data) {
+    // lines waiting to be drawn must see the video memory and registers as they were before this write
+    if (m_PendingFirstLine >= 0 && IsRasterAddress(address)) {
+        DrawPendingLines();
+    }
+
     if (m_BootMode && address == 0xFF50) {
         m_BootMode = false;
         ResetCPU();
@@ -504,6 +778,20 @@ void Emulator::WriteByte(WORD address, BYTE data) {
     else if ((address >= 0xFEA0) && (address <= 0xFEFF)) {
     }
 
+    // VRAM and OAM. The renderer is only told about writes that change something, either through the render
+    // thread's queue or by bumping the version of the tile so the background cache redraws it
+    else if ((address >= 0x8000 && address <= 0x9FFF) || (address >= 0xFE00 && address <= 0xFE9F)) {
+        if (m_Rom[address] != data) {
+            m_Rom[address] = data ;
+
+            if (m_RenderThread) {
+                MirrorVideoWrite(address, data) ;
+            } else if (address < 0x9800) {
+                m_TileVersion[(address - 0x8000) >> 4]++ ;
+            }
+        }
+    }
+
     // reset the divider register
     else if (address == 0xFF04) {
         m_Rom[0xFF04] = 0 ;
@@ -543,22 +831,50 @@ void Emulator::WriteByte(WORD address, BYTE data) {
     }
 
 
+    else if (address == 0xFF40) {
+        bool wasEnabled = TestBit(m_Rom[0xFF40], 7) ;
+        m_Rom[address] = data ;
+
+        // switching the LCD off resets LY, switching it back on starts again at line 0
+        if (wasEnabled && !TestBit(data, 7)) {
+            m_Rom[0xFF44] = 0 ;
+        } else if (!wasEnabled && TestBit(data, 7)) {
+            StartLCD( ) ;
+        }
+    }
+
+    // the mode and coincidence bits are read only
+    else if (address == 0xFF41) {
+        m_Rom[address] = data & 0x78 ;
+    }
+
     // FF44 shows which horizontal scanline is currently being draw. Writing here resets it
     else if (address == 0xFF44) {
         m_Rom[0xFF44] = 0 ;
+        CheckCoincidence( ) ;
     }
 
     else if (address == 0xFF45) {
         m_Rom[address] = data ;
+        CheckCoincidence( ) ;
     }
     // DMA transfer
     else if (address == 0xFF46) {
         WORD newAddress = (data << 8) ;
         for (int i = 0; i < 0xA0; i++) {
             m_Rom[0xFE00 + i] = ReadMemory(newAddress + i);
+
+            if (m_RenderThread) {
+                MirrorVideoWrite(0xFE00 + i, m_Rom[0xFE00 + i]) ;
+            }
         }
     }
 
+    // sound registers and wave RAM
+    else if ((address >= 0xFF10) && (address <= 0xFF3F)) {
+        m_Apu.WriteRegister(address, data, GetTotalCycles()) ;
+    }
+
     // This area is restricted.
     else if ((address >= 0xFF4C) && (address <= 0xFF7F)) {
     }
@@ -617,33 +933,61 @@ void Emulator::IssueVerticalBlank( ) {
         //OutputDebugStr(STR::Format("Total VBlanks was: %d\n", vblankcount)) ;
         vblankcount = 0 ;
     }
+
+    // the frame is complete, hand it over to the front end and decide whether the next one gets drawn
+    if (m_RenderThisFrame) {
+        if (m_RenderThread) {
+            RenderCommand command ;
+            command.type = RENDER_PUBLISH_FRAME ;
+            PushRenderCommand(command) ;
+            m_PublishCommand = m_RenderCommandsPushed ;
+        } else {
+            DrawPendingLines( ) ;
+            m_FrameBuffer.Publish( ) ;
+        }
+
+        m_FrameRendered = true ;
+    }
+
+    m_FrameSkipCounter = (m_FrameSkipCounter + 1) % m_FramePeriod ;
+    m_RenderThisFrame = !m_Headless && ((m_FrameSkipCounter * m_FramesRendered) % m_FramePeriod) < m_FramesRendered ;
+
+    // the render thread was not sent the video writes of the frames that were skipped
+    if (m_RenderThisFrame && m_VideoMirrorStale) {
+        WaitForRenderThread(m_RenderCommandsPushed) ;
+        SyncVideoMirror( ) ;
+    }
 }
 
 //////////////////////////////////////////////////////////////////
 
+// moves the LCD on to the next line once H-Blank (or a V-Blank line) is over
 void Emulator::DrawCurrentLine() {
-    // LCD must be enabled
-    if (!TestBit(ReadMemory(0xFF40), 7)) {
-        return;
-    }
+    BYTE Ly = m_Rom[0xFF44] + 1; // increment LY
 
-    m_Rom[0xFF44]++; // increment LY
-    m_RetraceLY = RETRACE_START; // draw another line if this counter reaches 0
+    if (Ly > VERTICAL_BLANK_SCAN_LINE_MAX) {
+        Ly = 0;
+    }
 
-    BYTE Ly = ReadMemory(0xFF44);
+    m_Rom[0xFF44] = Ly;
 
     // V-Blank occurs if LY is between 144 and 153
-    if (Ly == VERTICAL_BLANK_SCAN_LINE) {
-        IssueVerticalBlank();
-    }
+    if (Ly >= VERTICAL_BLANK_SCAN_LINE) {
+        if (Ly == VERTICAL_BLANK_SCAN_LINE) {
+            SetLCDMode(1);
+            IssueVerticalBlank();
+        }
+        m_ModeCycles += RETRACE_START;
+    } else {
+        SetLCDMode(2);
+        m_ModeCycles += OAM_SEARCH_CYCLES;
 
-    if (Ly > VERTICAL_BLANK_SCAN_LINE_MAX) {
-        m_Rom[0xFF44] = 0;
+        if (m_RenderThisFrame) {
+            QueueScanLine(Ly);
+        }
     }
 
-    if (Ly < VERTICAL_BLANK_SCAN_LINE) {
-        DrawScanLine();
-    }
+    CheckCoincidence();
 }
 
 //////////////////////////////////////////////////////////////////
@@ -727,104 +1071,229 @@ void Emulator::ServiceInterrupt( int num ) {
 
 //////////////////////////////////////////////////////////////////
 
-void Emulator::DrawScanLine() {
-    BYTE LCDControl = ReadMemory(0xFF40);
+// scanlines are not drawn when LY reaches them. They are queued and drawn in one batch, either at V-Blank
+// or as soon as something writes to video memory or to a register that changes what would be drawn
+// (see IsRasterAddress). Frames without raster effects are therefore drawn all at once, and frames with
+// them are drawn in batches between the writes, with exactly the same result as drawing line by line
+void Emulator::QueueScanLine(BYTE line) {
+    // the render thread gets the registers as they are now and draws the line whenever it gets to it
+    if (m_RenderThread) {
+        RenderCommand command;
+        command.type = RENDER_DRAW_LINE;
+        command.registers = GetLineRegisters(line);
+        PushRenderCommand(command);
+        return;
+    }
+
+    if (m_PendingFirstLine >= 0 && line != m_PendingLastLine + 1) {
+        DrawPendingLines();
+    }
+
+    if (m_PendingFirstLine < 0) {
+        m_PendingFirstLine = line;
+    }
+    m_PendingLastLine = line;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Emulator::DrawPendingLines( ) {
+    if (m_PendingFirstLine < 0) {
+        return;
+    }
+
+    for (int line = m_PendingFirstLine; line <= m_PendingLastLine; line++) {
+        DrawScanLine(GetLineRegisters(line), &m_Rom[0x8000], &m_Rom[0xFE00]);
+    }
+
+    m_PendingFirstLine = -1;
+    m_PendingLastLine = -1;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// true if writing to this address can change the output of DrawScanLine (VRAM, OAM, LCDC, scroll, LY, DMA,
+// palettes and window position)
+bool Emulator::IsRasterAddress(WORD address) const {
+    if (address < 0x8000) {
+        return false;
+    }
+
+    if (address <= 0x9FFF) {
+        return true;
+    }
+
+    if (address >= 0xFE00 && address <= 0xFE9F) {
+        return true;
+    }
+
+    return address >= 0xFF40 && address <= 0xFF4B && address != 0xFF41 && address != 0xFF45;
+}
+
+//////////////////////////////////////////////////////////////////
+
+Emulator::LineRegisters Emulator::GetLineRegisters(BYTE line) const {
+    LineRegisters registers;
+
+    registers.line = line;
+    registers.lcdControl = m_Rom[0xFF40];
+    registers.scrollY = m_Rom[0xFF42];
+    registers.scrollX = m_Rom[0xFF43];
+    registers.windowY = m_Rom[0xFF4A];
+    registers.windowX = m_Rom[0xFF4B];
+    registers.backgroundPalette = m_Rom[0xFF47];
+    registers.spritePalette0 = m_Rom[0xFF48];
+    registers.spritePalette1 = m_Rom[0xFF49];
+
+    return registers;
+}
+
+//////////////////////////////////////////////////////////////////
 
+// draws a line from a register snapshot. vram points at 0x8000 and oam at 0xFE00, either in m_Rom or in the
+// render thread's mirror, the renderers never read memory any other way
+void Emulator::DrawScanLine(const LineRegisters& registers, const BYTE* vram, const BYTE* oam) {
     // LCD must be enabled
-    if (TestBit(LCDControl, 7)) {
-        RenderBackground(LCDControl);
-        RenderSprites(LCDControl);
+    if (TestBit(registers.lcdControl, 7)) {
+        RenderBackground(registers, vram);
+        RenderSprites(registers, vram, oam);
+        ComposeScanLine(registers);
     }
 }
 
 //////////////////////////////////////////////////////////////////
 
-void Emulator::RenderBackground(BYTE LCDControl) {
-    // lets draw the background (however it does need to be enabled)
+// the background pass only produces colour numbers (0-3) into m_BackgroundLine. The palette is applied
+// much later (see ComposeScanLine) so the sprite pass never has to read back from the framebuffer. The
+// line is two spans, background up to WX-7 and window from there to the end, each copied out of the tile
+// map caches
+void Emulator::RenderBackground(const LineRegisters& registers, const BYTE* vram) {
+    BYTE LCDControl = registers.lcdControl;
+    BYTE Ly = registers.line;
+
+    // the window keeps its own line counter which only moves on lines the window was drawn on, so hiding
+    // the window for a few lines carries on from where it left off rather than skipping ahead
+    if (Ly == 0) {
+        m_WindowLine = 0;
+    }
+
+    // lets draw the background (however it does need to be enabled). A disabled background is colour 0
     if (!TestBit(LCDControl, 0)) {
+        memset(m_BackgroundLine, 0, sizeof(m_BackgroundLine));
         return;
     }
 
-    BYTE ScY = ReadMemory(0xFF42);
-    BYTE ScX = ReadMemory(0xFF43);
-    BYTE WndY = ReadMemory(0xFF4A);
-    BYTE WndX = ReadMemory(0xFF4B) - 7;
-    BYTE Ly = ReadMemory(0xFF44);
+    // which cache to copy from: bit 1 is the map (0x9800 or 0x9C00), bit 0 is set for the signed 0x8800 tiles
+    int tileData = TestBit(LCDControl, 4) ? 0 : 1;
+    int backgroundCache = (TestBit(LCDControl, 3) ? 2 : 0) | tileData;
+    int windowCache = (TestBit(LCDControl, 6) ? 2 : 0) | tileData;
 
-    WORD wndTileMem = TestBit(LCDControl, 4) ? 0x8000 : 0x8800;
+    // the window is drawn if it is enabled, LY has reached WY and WX puts it on screen
+    int windowStart = 160;
+    if (TestBit(LCDControl, 5) && registers.windowY <= Ly && registers.windowX <= 166) {
+        windowStart = std::max(registers.windowX - 7, 0);
+    }
 
-    bool _signed = wndTileMem == 0x8800;
-    bool usingWnd = TestBit(LCDControl, 5) && WndY <= Ly; // true if window display is enabled (specified in LCDC) and WndY <= LY
+    FetchBackgroundRow(backgroundCache, registers.scrollY + Ly, registers.scrollX, m_BackgroundLine, windowStart, vram);
 
-    WORD bkgdTileMem = TestBit(LCDControl, usingWnd ? 6 : 3) ? 0x9C00 : 0x9800;
+    if (windowStart < 160) {
+        // a WX below 7 pushes the left edge of the window off the screen
+        BYTE windowX = registers.windowX < 7 ? 7 - registers.windowX : 0;
 
-    // the y-position is used to determine which of 32 (256 / 8) vertical tiles will used (background map y)
-    BYTE yPos = !usingWnd ? ScY + Ly : Ly - WndY; // map to window coordinates if necessary
-    WORD tileRow = ((BYTE) (yPos / 8)) * 32; // which of 8 vertical pixels of the current tile is the scanline on?
+        FetchBackgroundRow(windowCache, m_WindowLine, windowX, m_BackgroundLine + windowStart, 160 - windowStart, vram);
+        m_WindowLine++;
+    }
+}
 
-    // time to draw a scanline which consists of 160 pixels
-    for (int pixel = 0; pixel < 160; pixel++) {
-        BYTE xPos = usingWnd && pixel >= WndX ? pixel - WndX : ScX + pixel;
-        WORD tileCol = xPos / 8; // which of horizontal pixels of the current tile does xPos fall in?
-        WORD tileAddr = bkgdTileMem + tileRow + tileCol;
-        SIGNED_WORD tileNum = _signed ? (SIGNED_BYTE) ReadMemory(tileAddr) : (BYTE) ReadMemory(tileAddr);
-        WORD tileLocation = wndTileMem + (_signed ? (tileNum + 128) * 16 : tileNum * 16);
-
-        // determine the correct row of pixels
-        BYTE line = yPos % 8;
-        line *= 2; // each line needs 2 bytes of memory so...
-
-        BYTE data1 = ReadMemory(tileLocation + line);
-        BYTE data2 = ReadMemory(tileLocation + line + 1);
-
-        int bit = 7 - (xPos % 8); // bit position in data1 and data2 (because pixel 0 corresponds to bit 7 and pixel 1 corresponds to bit 6 and so on)
-        int colourNum = (BitGetVal(data2, bit) << 1) | BitGetVal(data1, bit);
-
-        COLOUR col = GetColour(colourNum, 0xFF47);
-        int red;
-        int green;
-        int blue;
-
-        switch (col) {
-        case LIGHTEST_GREEN:
-            red = 155;
-            green = 188;
-            blue = 15;
-            break;
-        case LIGHT_GREEN:
-            red = 139;
-            green = 172;
-            blue = 15;
-            break;
-        case DARK_GREEN:
-            red = 48;
-            green = 98;
-            blue = 48;
-            break;
-        case DARKEST_GREEN:
-            red = 15;
-            green = 56;
-            blue = 15;
-            break;
+//////////////////////////////////////////////////////////////////
+
+// copies count colour numbers of row y of a tile map, starting at x and wrapping around at 256. Any 8x8 cell
+// the copy touches is redrawn first if its map entry now points at another tile or that tile was written to
+void Emulator::FetchBackgroundRow(int cache, BYTE y, BYTE x, BYTE* dest, int count, const BYTE* vram) {
+    if (count <= 0) {
+        return;
+    }
+
+    BackgroundCache& image = m_BackgroundCache[cache];
+    const BYTE* map = vram + (TestBit(cache, 1) ? 0x1C00 : 0x1800);
+    bool _signed = TestBit(cache, 0);
+
+    int cellRow = (y / 8) * 32;
+    int firstCol = x / 8;
+    int numCells = ((x % 8) + count + 7) / 8;
+
+    for (int i = 0; i < numCells; i++) {
+        int cell = cellRow + ((firstCol + i) % 32);
+        WORD tile = _signed ? 256 + (SIGNED_BYTE) map[cell] : map[cell];
+
+        if (image.cellTile[cell] != tile || image.cellVersion[cell] != m_TileVersion[tile]) {
+            DrawBackgroundCell(image, cell, tile, vram);
         }
+    }
 
-        if ((Ly < 0) || (Ly > 143) || (pixel < 0) || (pixel > 159)) {
-            assert(false);
-            continue;
+    const BYTE* row = &image.pixels[y * 256];
+    int firstPart = std::min(count, 256 - x);
+
+    memcpy(dest, row + x, firstPart);
+    memcpy(dest + firstPart, row, count - firstPart);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void Emulator::DrawBackgroundCell(BackgroundCache& image, int cell, WORD tile, const BYTE* vram) {
+    const BYTE* data = vram + tile * 16;
+    BYTE* out = &image.pixels[(cell / 32) * 8 * 256 + (cell % 32) * 8];
+
+    for (int line = 0; line < 8; line++) {
+        BYTE data1 = data[line * 2];
+        BYTE data2 = data[line * 2 + 1];
+
+        for (int pixel = 0; pixel < 8; pixel++) {
+            int bit = 7 - pixel; // pixel 0 is bit 7
+            out[line * 256 + pixel] = (BitGetVal(data2, bit) << 1) | BitGetVal(data1, bit);
+        }
+    }
+
+    image.cellTile[cell] = tile;
+    image.cellVersion[cell] = m_TileVersion[tile];
+}
+
+//////////////////////////////////////////////////////////////////
+
+// forgets every cached cell. Must be called whenever the renderer's VRAM changes without going through the
+// tile versions (reset, or the render thread's mirror being copied again)
+void Emulator::InvalidateBackgroundCache( ) {
+    for (int cache = 0; cache < 4; cache++) {
+        for (int cell = 0; cell < 32 * 32; cell++) {
+            m_BackgroundCache[cache].cellTile[cell] = BACKGROUND_CELL_INVALID;
         }
+    }
 
-        int offset = Ly * 160 * 4 + pixel * 4;
+    memset(m_TileVersion, 0, sizeof(m_TileVersion));
+}
 
-        m_ScreenData[offset] = blue;
-        m_ScreenData[offset + 1] = green;
-        m_ScreenData[offset + 2] = red;
-        m_ScreenData[offset + 3] = 255;
+//////////////////////////////////////////////////////////////////
+
+// drawn is the tile data the background cache was drawn from and vram what it is about to become, tiles that
+// differ get a new version so the cells using them are drawn again
+void Emulator::InvalidateChangedTiles(const BYTE* drawn, const BYTE* vram) {
+    for (int tile = 0; tile < 384; tile++) {
+        if (memcmp(drawn + tile * 16, vram + tile * 16, 16) != 0) {
+            m_TileVersion[tile]++;
+        }
     }
 }
 
 //////////////////////////////////////////////////////////////////
 
-void Emulator::RenderSprites(BYTE LCDControl) {
+// sprites are written into m_SpriteLine as (palette << 2) | colourNum where palette 1 is OBP0 and 2 is OBP1.
+// 0 means no sprite pixel so the background shows through
+void Emulator::RenderSprites(const LineRegisters& registers, const BYTE* vram, const BYTE* oam) {
+    BYTE LCDControl = registers.lcdControl;
+    BYTE Ly = registers.line;
+
+    memset(m_SpriteLine, 0, sizeof(m_SpriteLine));
+
     // lets draw the sprites (however it does need to be enabled)
     if (!TestBit(LCDControl, 1)) {
         return;
@@ -836,15 +1305,14 @@ void Emulator::RenderSprites(BYTE LCDControl) {
     for (int i = 0; i < 40; i++) {
         int index = i * 4; // each sprite takes 4 bytes of OAM space (0xFE00-0xFE9F)
 
-        BYTE spriteY = ReadMemory(0xFE00 + index) - 16;
-        BYTE spriteX = ReadMemory(0xFE00 + index + 1) - 8;
-        BYTE patternNumber = ReadMemory(0xFE00 + index + 2);
-        BYTE attributes = ReadMemory(0xFE00 + index + 3);
+        BYTE spriteY = oam[index] - 16;
+        BYTE spriteX = oam[index + 1] - 8;
+        BYTE patternNumber = oam[index + 2];
+        BYTE attributes = oam[index + 3];
 
         bool xFlip = TestBit(attributes, 5);
         bool yFlip = TestBit(attributes, 6);
 
-        int Ly = ReadMemory(0xFF44);
         int height = use8x16 ? 16 : 8;
 
         // does the scanline intercept this sprite?
@@ -855,10 +1323,12 @@ void Emulator::RenderSprites(BYTE LCDControl) {
             }
             line *= 2; // each line takes 2 bytes of memory
 
-            WORD tileLocation = 0x8000 + (patternNumber * 16);
+            WORD tileLocation = patternNumber * 16; // relative to 0x8000
 
-            BYTE data1 = ReadMemory(tileLocation + line);
-            BYTE data2 = ReadMemory(tileLocation + line + 1);
+            BYTE data1 = vram[tileLocation + line];
+            BYTE data2 = vram[tileLocation + line + 1];
+
+            BYTE palette = TestBit(attributes, 4) ? 2 : 1;
 
             for (int tilePixel = 7; tilePixel >= 0; tilePixel--) {
                 int bit = tilePixel;
@@ -867,53 +1337,25 @@ void Emulator::RenderSprites(BYTE LCDControl) {
                 }
 
                 int colourNum = (BitGetVal(data2, bit) << 1) | BitGetVal(data1, bit);
-                COLOUR col = GetColour(colourNum, TestBit(attributes, 4) ? 0xFF49 : 0xFF48);
 
-                // it's transparent for sprites
-                if (col == LIGHTEST_GREEN) {
+                // colour 0 is transparent for sprites
+                if (colourNum == 0) {
                     continue;
                 }
 
-                int red;
-                int green;
-                int blue;
-
-                switch (col) {
-                case LIGHT_GREEN:
-                    red = 139;
-                    green = 172;
-                    blue = 15;
-                    break;
-                case DARK_GREEN:
-                    red = 48;
-                    green = 98;
-                    blue = 48;
-                    break;
-                case DARKEST_GREEN:
-                    red = 15;
-                    green = 56;
-                    blue = 15;
-                    break;
-                }
-
                 int pixel = spriteX + (7 - tilePixel);
 
                 if ((Ly < 0) || (Ly > 143) || (pixel < 0) || (pixel > 159)) {
                     continue;
                 }
 
-                int offset = Ly * 160 * 4 + pixel * 4;
-
                 // check if pixel is hidden behind background
-                // if the bit 7 of attributes is set then the screen pixel colour must be lightest green before changing colour
-                if (TestBit(attributes, 7) && ((m_ScreenData[offset + 2] != 155) || (m_ScreenData[offset + 1] != 188) || (m_ScreenData[offset] != 15))) {
+                // if the bit 7 of attributes is set then the sprite only shows over background colour 0
+                if (TestBit(attributes, 7) && (m_BackgroundLine[pixel] != 0)) {
                     continue;
                 }
 
-                m_ScreenData[offset] = blue;
-                m_ScreenData[offset + 1] = green;
-                m_ScreenData[offset + 2] = red;
-                m_ScreenData[offset + 3] = 255;
+                m_SpriteLine[pixel] = (palette << 2) | colourNum;
             }
         }
     }
@@ -921,9 +1363,45 @@ void Emulator::RenderSprites(BYTE LCDControl) {
 
 //////////////////////////////////////////////////////////////////
 
-Emulator::COLOUR Emulator::GetColour(BYTE colourNum, WORD address) const {
+// combines the background and sprite colour numbers of the current line into the back frame together with
+// what BGP/OBP0/OBP1 make of them. The colours themselves are only worked out when the frame is presented
+// (see ResolveFrameLines) so this is the only place the framebuffer gets written
+void Emulator::ComposeScanLine(const LineRegisters& registers) {
+    BYTE Ly = registers.line;
+
+    if (Ly > 143) {
+        assert(false);
+        return;
+    }
+
+    // the line buffer entries index straight into this table: 0-3 background, 4-7 OBP0, 8-11 OBP1
+    BYTE* shades = m_FrameBuffer.GetBackShades(Ly);
+    for (int colourNum = 0; colourNum < 4; colourNum++) {
+        shades[colourNum] = GetColour(colourNum, registers.backgroundPalette);
+        shades[4 + colourNum] = GetColour(colourNum, registers.spritePalette0);
+        shades[8 + colourNum] = GetColour(colourNum, registers.spritePalette1);
+    }
+
+    // a disabled background is always the lightest shade regardless of BGP
+    if (!TestBit(registers.lcdControl, 0)) {
+        for (int colourNum = 0; colourNum < 4; colourNum++) {
+            shades[colourNum] = LIGHTEST_GREEN;
+        }
+    }
+
+    BYTE* out = m_FrameBuffer.GetBackLine(Ly);
+
+    for (int pixel = 0; pixel < 160; pixel++) {
+        out[pixel] = m_SpriteLine[pixel] ? m_SpriteLine[pixel] : m_BackgroundLine[pixel];
+    }
+
+    m_FrameBuffer.CommitLine(Ly);
+}
+
+//////////////////////////////////////////////////////////////////
+
+Emulator::COLOUR Emulator::GetColour(BYTE colourNum, BYTE palette) const {
     COLOUR res = LIGHTEST_GREEN;
-    BYTE palette = ReadMemory(address);
     int hi = 0;
     int lo = 0;
 
@@ -976,84 +1454,68 @@ Emulator::COLOUR Emulator::GetColour(BYTE colourNum, WORD address) const {
 
 //////////////////////////////////////////////////////////////////
 
-void Emulator::SetLCDStatus() {
-    BYTE LCDStatus = ReadMemory(0xFF41);
-
-    // if LCD is turned off
-    if (!TestBit(ReadMemory(0xFF40), 7)) {
-        m_RetraceLY = RETRACE_START;
-        m_Rom[0xFF44] = 0;
-
-        // LCD status must be in mode 1 when LCD is disabled
-        LCDStatus = BitSet(LCDStatus, 0);
-        LCDStatus = BitReset(LCDStatus, 1);
+// the LCD has just been switched on (or the CPU reset), it starts at the beginning of line 0
+void Emulator::StartLCD( ) {
+    m_Rom[0xFF44] = 0;
+    m_ModeCycles = OAM_SEARCH_CYCLES;
+    SetLCDMode(2);
 
-        WriteByte(0xFF41, LCDStatus);
-        return;
+    if (m_RenderThisFrame) {
+        QueueScanLine(0);
     }
 
-    BYTE Ly = ReadMemory(0xFF44);
-    BYTE oldMode = GetLCDMode();
+    CheckCoincidence();
+}
 
-    BYTE mode = 0;
-    bool reqInt = false;
+//////////////////////////////////////////////////////////////////
 
-    // if in the V-Blank period
-    if (Ly >= VERTICAL_BLANK_SCAN_LINE) {
-        mode = 1;
+void Emulator::SetLCDMode(BYTE mode) {
+    m_LCDMode = mode;
 
-        // set to mode 1
-        LCDStatus = BitSet(LCDStatus, 0);
-        LCDStatus = BitReset(LCDStatus, 1);
+    BYTE LCDStatus = m_Rom[0xFF41];
+    bool reqInt = false;
 
+    switch (mode) {
+    case 0:
+        reqInt = TestBit(LCDStatus, 3); // is mode 0 H-Blank interrupt enabled?
+        break;
+    case 1:
         reqInt = TestBit(LCDStatus, 4); // is mode 1 V-Blank interrupt enabled?
-    } else {
-        int mode2Bounds = RETRACE_START - 80;
-        int mode3Bounds = mode2Bounds - 172;
-
-        if (m_RetraceLY >= mode2Bounds) {
-            mode = 2;
-
-            // set to mode 2
-            LCDStatus = BitReset(LCDStatus, 0);
-            LCDStatus = BitSet(LCDStatus, 1);
-
-            reqInt = TestBit(LCDStatus, 5); // is mode 2 OAM interrupt enabled?
-        } else if (m_RetraceLY >= mode3Bounds) {
-            mode = 3;
+        break;
+    case 2:
+        reqInt = TestBit(LCDStatus, 5); // is mode 2 OAM interrupt enabled?
+        break;
+    }
 
-            // set to mode 3
-            LCDStatus = BitSet(LCDStatus, 0);
-            LCDStatus = BitSet(LCDStatus, 1);
-        } else {
-            mode = 0;
+    if (reqInt) {
+        RequestInterupt(1); // request LCDStat interrupt
+    }
+}
 
-            // set to mode 0
-            LCDStatus = BitReset(LCDStatus, 0);
-            LCDStatus = BitReset(LCDStatus, 1);
+//////////////////////////////////////////////////////////////////
 
-            reqInt = TestBit(LCDStatus, 3); // is mode 0 H-Blank interrupt enabled?
-        }
+// called whenever LY or LYC changes
+void Emulator::CheckCoincidence( ) {
+    // is LYC=LY coincidence interrupt enabled?
+    if (m_Rom[0xFF44] == m_Rom[0xFF45] && TestBit(m_Rom[0xFF41], 6)) {
+        RequestInterupt(1); // then request LCDStat interrupt
     }
+}
 
-    if (reqInt && mode != oldMode) {
-        RequestInterupt(1); // request LCDStat interrupt
-    }
+//////////////////////////////////////////////////////////////////
 
-    BYTE Lyc = ReadMemory(0xFF45);
+// STAT as the CPU sees it. Only the interrupt enable bits are stored in m_Rom[0xFF41], the mode and the
+// coincidence flag are worked out when it is read
+BYTE Emulator::GetLCDStatus( ) const {
+    BYTE LCDStatus = (m_Rom[0xFF41] & 0x78) | 0x80;
 
-    if (Lyc == Ly) {
-        LCDStatus = BitSet(LCDStatus, 2);
+    LCDStatus |= GetLCDMode();
 
-        // is LYC=LY coincidence interrupt enabled?
-        if (TestBit(LCDStatus, 6)) {
-            RequestInterupt(1); // then request LCDStat interrupt
-        }
-    } else {
-        LCDStatus = BitReset(LCDStatus, 2);
+    if (m_Rom[0xFF44] == m_Rom[0xFF45]) {
+        LCDStatus = BitSet(LCDStatus, 2);
     }
 
-    WriteByte(0xFF41, LCDStatus);
+    return LCDStatus;
 }
 
 //////////////////////////////////////////////////////////////////
@@ -1126,6 +1588,48 @@ void Emulator::KeyReleased(int key) {
 
 //////////////////////////////////////////////////////////////////
 
+void Emulator::QueueInput(int key, bool pressed, unsigned long long cycle) {
+    QueuedInput input ;
+    input.cycle = m_InputQueue.empty() ? cycle : std::max(cycle, m_InputQueue.back().cycle) ;
+    input.key = key ;
+    input.pressed = pressed ;
+    m_InputQueue.push_back(input) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// when the next queued input is due, in cycles from the start of this update. A long way off if nothing is queued
+int Emulator::GetNextInputTime( ) const {
+    if (m_InputQueue.empty()) {
+        return INT_MAX ;
+    }
+
+    unsigned long long cycle = m_InputQueue.front().cycle ;
+    if (cycle <= m_CyclesBeforeUpdate) {
+        return 0 ;
+    }
+    return (int) std::min(cycle - m_CyclesBeforeUpdate, (unsigned long long) INT_MAX) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// everything that is due by now
+void Emulator::ApplyQueuedInput( ) {
+    unsigned long long now = GetTotalCycles() ;
+
+    while (!m_InputQueue.empty() && m_InputQueue.front().cycle <= now) {
+        const QueuedInput& input = m_InputQueue.front() ;
+        if (input.pressed) {
+            KeyPressed(input.key) ;
+        } else {
+            KeyReleased(input.key) ;
+        }
+        m_InputQueue.pop_front() ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
 static int timerhack = 0 ;
 
 void Emulator::DoTimers( int cycles ) {
@@ -1166,10 +1670,15 @@ void Emulator::DoTimers( int cycles ) {
 //////////////////////////////////////////////////////////////////
 
 void Emulator::CreateRamBanks(int numBanks) {
+    // banks left over from the last game
+    for (std::vector<BYTE*>::iterator it = m_RamBank.begin(); it != m_RamBank.end(); it++)
+        delete[] (*it) ;
+    m_RamBank.clear() ;
+
     // DOES THE FIRST RAM BANK NEED TO BE SET TO THE CONTENTS of m_Rom[0xA000] - m_Rom[0xC000]?
     for (int i = 0; i < 17; i++) {
         BYTE* ram = new BYTE[0x2000] ;
-        memset(ram, 0, sizeof(ram)) ;
+        memset(ram, 0, 0x2000) ;
         m_RamBank.push_back(ram) ;
     }
 
@@ -1188,8 +1697,11 @@ void Emulator::RequestInterupt(int bit) {
 //////////////////////////////////////////////////////////////////
 
 BYTE Emulator::GetLCDMode() const {
-    BYTE lcdStatus = m_Rom[0xFF41] ;
-    return lcdStatus & 0x3 ;
+    // LCD status must be in mode 1 when LCD is disabled
+    if (!TestBit(m_Rom[0xFF40], 7))
+        return 1 ;
+
+    return m_LCDMode ;
 }
 
 //////////////////////////////////////////////////////////////////
@@ -2,8 +2,15 @@
 #ifndef _EMULATOR_H
 #define _EMULATOR_H
 
+#include <atomic>
+#include <deque>
+#include <thread>
 #include <vector>
 
+#include "Apu.h"
+#include "FrameBuffer.h"
+#include "RingBuffer.h"
+
 typedef unsigned char BYTE ;
 typedef char SIGNED_BYTE ;
 typedef unsigned short WORD ;
@@ -42,12 +49,73 @@ const int bootROM[] = {
 
 class Emulator {
   public:
+    // a snapshot of everything that decides what the game does next. The cartridge ROM never changes so it
+    // isn't in here, and neither is anything that only affects what has already been drawn
+    struct State {
+        BYTE				memory[0x8000] ;			// 0x8000 - 0xFFFF
+        BYTE				ramBanks[4][0x2000] ;		// only the first 4 can ever be switched in
+        WORD				registers[6] ;				// AF, BC, DE, HL, SP and PC
+        int					cyclesThisUpdate ;
+        unsigned long long	cyclesBeforeUpdate ;
+        unsigned long long	totalOpcodes ;
+        int					currentRomBank ;
+        int					currentRamBank ;
+        bool				enableRamBank ;
+        bool				usingMemoryModel16_8 ;
+        bool				enableInterupts ;
+        bool				pendingInteruptDisabled ;
+        bool				pendingInteruptEnabled ;
+        bool				halted ;
+        bool				bootMode ;
+        int					modeCycles ;
+        BYTE				lcdMode ;
+        BYTE				joypadState ;
+        int					timerVariable ;
+        int					dividerVariable ;
+        int					currentClockSpeed ;
+        int					frameSkipCounter ;			// so running ahead doesn't move frame skipping on
+        bool				renderThisFrame ;
+        Apu					apu ;
+    };
+
     Emulator			( bool enableBootROM );
     ~Emulator			(void);
 
     bool				LoadRom				(const std::string& romName) ;
     void				SetRenderFunc       ( RenderFunc func ) ;
-    void				Update				( ) ;
+    bool				Update				( ) ;
+    void				SetFrameSkip		( int framesRendered, int framePeriod ) ;
+    void				SetHeadless			( bool headless ) ;
+    void				SetRenderThread		( bool enabled ) ;
+    // show the frame this many frames (0 - 3) ahead of the game, see UpdateRunAhead
+    void				SetRunAhead			( int frames ) ;
+    int					GetRunAhead			( ) const {
+        return m_RunAhead ;
+    }
+    void				SaveState			( State& state ) const ;
+    void				LoadState			( const State& state ) ;
+    bool				IsRenderThreadEnabled( ) const {
+        return m_RenderThread != NULL ;
+    }
+    bool				IsHeadless			( ) const {
+        return m_Headless ;
+    }
+    FrameBuffer*		GetFrameBuffer		( ) {
+        return &m_FrameBuffer ;
+    }
+    // hash of the frame completed by the last call to Update (only meaningful if it returned true) and of
+    // each of its lines, for comparing runs without looking at the pixels. They cover the colour numbers and
+    // the shades the palettes give them, so a palette change no pixel uses still changes the hash.
+    // A line hash is XXH64 of its 160 colour numbers, seeded with XXH64 (seed 0) of its 12 shade bytes. The
+    // frame hash is XXH64 (seed 0) of the 144 line hashes as 8 little endian bytes each, top line first
+    unsigned long long	GetFrameHash		( ) const {
+        return m_FrameBuffer.GetPublishedHash() ;
+    }
+    unsigned long long	GetLineHash			( int line ) const {
+        return m_FrameBuffer.GetPublishedLineHash(line) ;
+    }
+    // hash of the CPU registers, the memory map and the cartridge RAM, for checking two runs ended up the same
+    unsigned long long	GetStateHash		( ) const ;
     void				StopGame			( ) ;
     std::string			GetCurrentOpcode	( ) const ;
     std::string			GetImmediateData1	( ) const ;
@@ -80,12 +148,39 @@ class Emulator {
     }
     void				KeyPressed			( int key ) ;
     void				KeyReleased			( int key ) ;
+    // the button changes at the first instruction boundary on or after cycle, a GetTotalCycles count, and the
+    // joypad interrupt comes from that point. A cycle that has already gone is the start of the next update.
+    // Changes happen in the order they are queued, an earlier cycle than the last one queued is moved up to it
+    void				QueueInput			( int key, bool pressed, unsigned long long cycle ) ;
     void				SetPauseFunction	( PauseFunc func ) {
         m_TimeToPause = func ;
     }
     unsigned long long	GetTotalOpcodes		( ) const {
         return m_TotalOpcodes;
     }
+    // how many cycles the last Update ran for, it stops at the first instruction past a frame's worth
+    int					GetCyclesThisUpdate	( ) const {
+        return m_CyclesThisUpdate;
+    }
+    // every cycle run since the emulator was created, it never goes backwards
+    unsigned long long	GetTotalCycles		( ) const {
+        return m_CyclesBeforeUpdate + m_CyclesThisUpdate;
+    }
+    // sound is off until it is given a sample rate, 0 turns it off again
+    void				SetAudioSampleRate	( int sampleRate ) {
+        m_Apu.SetSampleRate(sampleRate);
+    }
+    // stereo samples from the frames run so far, interleaved left and right
+    int					GetAudioSamplesAvailable( ) const {
+        return m_Apu.GetSamplesAvailable();
+    }
+    int					ReadAudioSamples	( short* out, int maxSamples ) {
+        return m_Apu.ReadSamples(out, maxSamples);
+    }
+    // a small change to how many samples a frame makes, for keeping in step with the sound card (see Apu)
+    void				SetAudioRateAdjust	( double adjust ) {
+        m_Apu.SetRateAdjust(adjust);
+    }
     void				SetPausePending		( bool pending ) {
         m_DebugPause = false ;
         m_DebugPausePending = pending ;
@@ -94,9 +189,6 @@ class Emulator {
         m_DebugPause = pause;
     }
 
-
-    std::vector<BYTE>   m_ScreenData;
-
   private:
     enum COLOUR {
         LIGHTEST_GREEN,
@@ -105,23 +197,90 @@ class Emulator {
         DARKEST_GREEN
     };
 
+    // everything a scanline depends on apart from VRAM and OAM, as it was when the line started
+    struct LineRegisters {
+        BYTE line ;
+        BYTE lcdControl ;
+        BYTE scrollY ;
+        BYTE scrollX ;
+        BYTE windowY ;
+        BYTE windowX ;
+        BYTE backgroundPalette ;
+        BYTE spritePalette0 ;
+        BYTE spritePalette1 ;
+    };
+
+    enum RENDER_COMMAND {
+        RENDER_DRAW_LINE,
+        RENDER_WRITE_VIDEO,
+        RENDER_PUBLISH_FRAME,
+        RENDER_QUIT
+    };
+
+    // a tile map drawn out to 256x256 colour numbers. There is one for each map (0x9800 and 0x9C00) with each
+    // tile data area (0x8000 and 0x8800), see FetchBackgroundRow
+    struct BackgroundCache {
+        BYTE pixels[256 * 256] ;
+        WORD cellTile[32 * 32] ;			// tile (0-383) each 8x8 cell was drawn from, or BACKGROUND_CELL_INVALID
+        unsigned int cellVersion[32 * 32] ;	// m_TileVersion of that tile when the cell was drawn
+    };
+
+    // one entry in the queue from the emulation thread to the render thread. For RENDER_WRITE_VIDEO the
+    // address is an offset into m_VideoMirror
+    struct RenderCommand {
+        BYTE type ;
+        BYTE data ;
+        WORD address ;
+        LineRegisters registers ;
+    };
+
+    // a button change waiting for its cycle, a GetTotalCycles count
+    struct QueuedInput {
+        unsigned long long	cycle ;
+        int					key ;
+        bool				pressed ;
+    };
+
     BYTE				GetLCDMode			( ) const ;
-    void				SetLCDStatus		( ) ;
+    BYTE				GetLCDStatus		( ) const ;
+    void				SetLCDMode			( BYTE mode ) ;
+    void				StartLCD			( ) ;
+    void				CheckCoincidence	( ) ;
     BYTE				GetJoypadState		( ) const ;
     void				CreateRamBanks		( int numBanks ) ;
 
     BYTE				ReadMemory			( WORD memory ) const;
     bool				ResetCPU			( ) ;
     void				ResetScreen			( ) ;
+    bool				RunFrame			( ) ;
+    int					GetNextInputTime	( ) const ;
+    void				ApplyQueuedInput	( ) ;
+    bool				UpdateRunAhead		( ) ;
+    void				SkipCurrentFrame	( ) ;
+    void				InvalidateChangedTiles( const BYTE* drawn, const BYTE* vram ) ;
     void				DoInterupts			( ) ;
     void				DoGraphics			( int cycles ) ;
     void				ServiceInterrupt	( int num) ;
-    void				DrawScanLine		( ) ;
-    COLOUR				GetColour			( BYTE colourNumber, WORD address ) const ;
+    void				DrawScanLine		( const LineRegisters& registers, const BYTE* vram, const BYTE* oam ) ;
+    void				QueueScanLine		( BYTE line ) ;
+    void				DrawPendingLines	( ) ;
+    bool				IsRasterAddress		( WORD address ) const ;
+    LineRegisters		GetLineRegisters	( BYTE line ) const ;
+    COLOUR				GetColour			( BYTE colourNumber, BYTE palette ) const ;
     void				DoTimers			( int cycles ) ;
 
-    void				RenderBackground	( BYTE lcdControl ) ;
-    void				RenderSprites		( BYTE lcdControl ) ;
+    void				RenderBackground	( const LineRegisters& registers, const BYTE* vram ) ;
+    void				FetchBackgroundRow	( int cache, BYTE y, BYTE x, BYTE* dest, int count, const BYTE* vram ) ;
+    void				DrawBackgroundCell	( BackgroundCache& cache, int cell, WORD tile, const BYTE* vram ) ;
+    void				InvalidateBackgroundCache( ) ;
+    void				RenderSprites		( const LineRegisters& registers, const BYTE* vram, const BYTE* oam ) ;
+    void				ComposeScanLine		( const LineRegisters& registers ) ;
+
+    void				RenderThreadMain	( ) ;
+    void				PushRenderCommand	( const RenderCommand& command ) ;
+    void				MirrorVideoWrite	( WORD address, BYTE data ) ;
+    void				SyncVideoMirror		( ) ;
+    void				WaitForRenderThread	( unsigned long long command ) ;
 
     void				ExecuteOpcode		( BYTE opcode ) ;
     void				ExecuteExtendedOpcode( ) ;
@@ -192,6 +351,13 @@ class Emulator {
 
     RenderFunc			m_RenderFunc ;
 
+    int					m_FramesRendered ;
+    int					m_FramePeriod ;
+    int					m_FrameSkipCounter ;
+    bool				m_RenderThisFrame ;
+    bool				m_Headless ;
+    bool				m_FrameRendered ;
+
 
     union Register {
         WORD reg ;
@@ -215,6 +381,7 @@ class Emulator {
     Register			m_RegisterDE ;
     Register			m_RegisterHL ;
     int					m_CyclesThisUpdate ;
+    unsigned long long	m_CyclesBeforeUpdate ;
 
     Register			m_StackPointer ;
     int					m_CurrentRomBank ;
@@ -223,10 +390,36 @@ class Emulator {
     bool				m_PendingInteruptDisabled ;
     bool				m_PendingInteruptEnabled ;
     int					m_CurrentRamBank ;
-    int					m_RetraceLY ;
+    int					m_ModeCycles ;
+    BYTE				m_LCDMode ;
+    BYTE				m_BackgroundLine[160] ;
+    BYTE				m_SpriteLine[160] ;
+    BackgroundCache		m_BackgroundCache[4] ;
+    unsigned int		m_TileVersion[384] ;	// bumped whenever the renderer's copy of a tile changes
+    int					m_WindowLine ;			// internal window line counter, only the renderer uses it
+    FrameBuffer			m_FrameBuffer ;
+    int					m_PendingFirstLine ;
+    int					m_PendingLastLine ;
+
+    // render thread, NULL when scanlines are drawn on the emulation thread
+    std::thread*		m_RenderThread ;
+    RingBuffer<RenderCommand, 4096>	m_RenderQueue ;
+    unsigned long long	m_RenderCommandsPushed ;
+    std::atomic<unsigned long long>	m_RenderCommandsDone ;
+    unsigned long long	m_PublishCommand ;
+    BYTE				m_VideoMirror[0x2000 + 0xA0] ;	// the render thread's copy of VRAM followed by OAM
+    bool				m_VideoMirrorStale ;
     bool				m_DebugPause ;
     bool				m_DebugPausePending ;
 
+    // reading NR52 brings the channels up to date, and ReadMemory is const
+    mutable Apu			m_Apu ;
+
+    int					m_RunAhead ;
+    State*				m_RunAheadState ;		// the end of the real frame, NULL until run-ahead is used
+
+    std::deque<QueuedInput>	m_InputQueue ;
+
     void				RequestInterupt( int bit ) ;
 
     WORD				ReadWord			( ) const ;
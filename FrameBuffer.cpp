@@ -0,0 +1,283 @@
+#include "FrameBuffer.h"
+
+#include <string.h>
+
+//////////////////////////////////////////////////////////////////
+
+FrameBuffer::FrameBuffer(void) :
+    m_Back(0)
+    ,m_Published(1)
+    ,m_PublishedFrame(1)
+    ,m_PublishedHash(0)
+    ,m_Front(2)
+    ,m_LastSequence(0)
+    ,m_FramesDropped(true)
+    ,m_Ready(1 | FRESH_BIT) {
+    memset(m_Frames, 0, sizeof(m_Frames));
+    memset(m_LineHashes, 0, sizeof(m_LineHashes));
+    memset(m_PublishedLineHashes, 0, sizeof(m_PublishedLineHashes));
+
+    for (int line = 0; line < FRAME_HEIGHT; line++) {
+        m_LineDirty[line] = true;
+    }
+
+    // the consumer starts with a blank frame waiting, so the screen gets cleared
+    m_Frames[1].dirtyFirstLine = 0;
+    m_Frames[1].dirtyLastLine = FRAME_HEIGHT - 1;
+}
+
+//////////////////////////////////////////////////////////////////
+
+FrameBuffer::~FrameBuffer(void) {
+}
+
+//////////////////////////////////////////////////////////////////
+
+// producer side. Publishes a blank frame, which reaches the consumer like any other. The consumer's frames
+// are left alone so it can carry on presenting while this happens
+void FrameBuffer::Clear( ) {
+    Frame& frame = m_Frames[m_Back];
+    memset(frame.indices, 0, sizeof(frame.indices));
+    memset(frame.shades, 0, sizeof(frame.shades));
+
+    // whatever is drawn next differs from this on every line
+    for (int line = 0; line < FRAME_HEIGHT; line++) {
+        m_LineHashes[line] = 0;
+        m_LineDirty[line] = true;
+    }
+
+    Publish( );
+}
+
+//////////////////////////////////////////////////////////////////
+
+unsigned char* FrameBuffer::GetBackLine(int line) {
+    return &m_Frames[m_Back].indices[line * FRAME_WIDTH];
+}
+
+//////////////////////////////////////////////////////////////////
+
+unsigned char* FrameBuffer::GetBackShades(int line) {
+    return m_Frames[m_Back].shades[line];
+}
+
+//////////////////////////////////////////////////////////////////
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+// XXH64 reads its input as little endian words, which is just a load everywhere this runs
+static inline unsigned long long Read64(const unsigned char* data) {
+    unsigned long long value;
+    memcpy(&value, data, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static inline unsigned int Read32(const unsigned char* data) {
+    unsigned int value;
+    memcpy(&value, data, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+static inline unsigned long long RotateLeft(unsigned long long value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline unsigned long long HashRound(unsigned long long acc, unsigned long long input) {
+    return RotateLeft(acc + input * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+static inline unsigned long long HashMerge(unsigned long long hash, unsigned long long acc) {
+    return (hash ^ HashRound(0, acc)) * HASH_PRIME1 + HASH_PRIME4;
+}
+
+// XXH64. The four lanes are independent so the compiler can keep them all in flight at once. The input is
+// read as little endian like the reference implementation does, so the output matches it on any machine
+unsigned long long HashBytes(const unsigned char* data, int length, unsigned long long seed) {
+    const unsigned char* end = data + length;
+    unsigned long long hash;
+
+    if (length >= 32) {
+        unsigned long long acc1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        unsigned long long acc2 = seed + HASH_PRIME2;
+        unsigned long long acc3 = seed;
+        unsigned long long acc4 = seed - HASH_PRIME1;
+
+        for (; data + 32 <= end; data += 32) {
+            acc1 = HashRound(acc1, Read64(data));
+            acc2 = HashRound(acc2, Read64(data + 8));
+            acc3 = HashRound(acc3, Read64(data + 16));
+            acc4 = HashRound(acc4, Read64(data + 24));
+        }
+
+        hash = RotateLeft(acc1, 1) + RotateLeft(acc2, 7) + RotateLeft(acc3, 12) + RotateLeft(acc4, 18);
+        hash = HashMerge(hash, acc1);
+        hash = HashMerge(hash, acc2);
+        hash = HashMerge(hash, acc3);
+        hash = HashMerge(hash, acc4);
+    } else {
+        hash = seed + HASH_PRIME5;
+    }
+
+    hash += (unsigned long long) length;
+
+    for (; data + 8 <= end; data += 8) {
+        hash = RotateLeft(hash ^ HashRound(0, Read64(data)), 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+
+    if (data + 4 <= end) {
+        hash = RotateLeft(hash ^ (Read32(data) * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+        data += 4;
+    }
+
+    for (; data < end; data++) {
+        hash = RotateLeft(hash ^ (*data * HASH_PRIME5), 11) * HASH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+// called once a line of the back frame has been written, while it is still in the cache. The hash covers
+// the indices and the shades so it changes whenever the line would look different: the 160 indices hashed
+// with the hash of the 12 shade bytes (itself seed 0) as the seed
+void FrameBuffer::CommitLine(int line) {
+    unsigned long long hash = HashBytes(GetBackShades(line), FRAME_LINE_SHADES, 0);
+    hash = HashBytes(GetBackLine(line), FRAME_WIDTH, hash);
+
+    if (hash != m_LineHashes[line]) {
+        m_LineHashes[line] = hash;
+        m_LineDirty[line] = true;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the back frame is complete. Record which lines changed since the last published frame and swap it
+// with the ready frame. Whatever frame comes back becomes the new back frame
+void FrameBuffer::Publish( ) {
+    Frame& frame = m_Frames[m_Back];
+
+    frame.sequence = m_Published++;
+    frame.dirtyFirstLine = -1;
+    frame.dirtyLastLine = -1;
+
+    for (int line = 0; line < FRAME_HEIGHT; line++) {
+        if (m_LineDirty[line]) {
+            if (frame.dirtyFirstLine < 0) {
+                frame.dirtyFirstLine = line;
+            }
+            frame.dirtyLastLine = line;
+            m_LineDirty[line] = false;
+        }
+    }
+
+    // the frame hash is of the line hashes as 8 little endian bytes each, top line first, seed 0
+    unsigned char lineHashBytes[sizeof(m_LineHashes)];
+    for (int line = 0; line < FRAME_HEIGHT; line++) {
+        for (int byte = 0; byte < 8; byte++) {
+            lineHashBytes[line * 8 + byte] = (unsigned char) (m_LineHashes[line] >> (byte * 8));
+        }
+    }
+
+    memcpy(frame.lineHashes, m_LineHashes, sizeof(m_LineHashes));
+    frame.frameHash = HashBytes(lineHashBytes, sizeof(lineHashBytes), 0);
+
+    // the producer's own copy, the frame itself belongs to the consumer as soon as it is swapped
+    memcpy(m_PublishedLineHashes, m_LineHashes, sizeof(m_LineHashes));
+    m_PublishedHash = frame.frameHash;
+
+    m_PublishedFrame = m_Back;
+    int previous = m_Ready.exchange(m_Back | FRESH_BIT, std::memory_order_acq_rel);
+    m_Back = previous & INDEX_MASK;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// makes the newest published frame the front frame. Returns false if nothing was published since the
+// last call, in which case the front frame is unchanged
+bool FrameBuffer::AcquireFrame( ) {
+    if (!(m_Ready.load(std::memory_order_relaxed) & FRESH_BIT)) {
+        return false;
+    }
+
+    int previous = m_Ready.exchange(m_Front, std::memory_order_acq_rel);
+    m_Front = previous & INDEX_MASK;
+
+    // if the producer published more than one frame since the last call the dirty lines of the frames
+    // in between are lost, so everything has to be treated as dirty
+    const Frame& frame = m_Frames[m_Front];
+    m_FramesDropped = frame.sequence != m_LastSequence + 1;
+    m_LastSequence = frame.sequence;
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the lines of the front frame that differ from the frame acquired before it. Returns false if the two
+// frames are identical
+bool FrameBuffer::GetDirtyLines(int& firstLine, int& lastLine) const {
+    const Frame& frame = m_Frames[m_Front];
+
+    if (m_FramesDropped) {
+        firstLine = 0;
+        lastLine = FRAME_HEIGHT - 1;
+        return true;
+    }
+
+    if (frame.dirtyFirstLine < 0) {
+        return false;
+    }
+
+    firstLine = frame.dirtyFirstLine;
+    lastLine = frame.dirtyLastLine;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// BGRA bytes of each shade, lightest first
+static const unsigned char shadeColours[4][4] = {
+    { 15, 188, 155, 255 },
+    { 15, 172, 139, 255 },
+    { 48, 98, 48, 255 },
+    { 15, 56, 15, 255 }
+};
+
+const unsigned char* GetShadeColour(int shade) {
+    return shadeColours[shade & 3];
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ResolveFrameLines(const Frame& frame, int firstLine, int lastLine, unsigned char* dest, int pitch) {
+    for (int line = firstLine; line <= lastLine; line++) {
+        // the indices of a line go straight into this table
+        unsigned int lookup[FRAME_LINE_SHADES];
+        for (int i = 0; i < FRAME_LINE_SHADES; i++) {
+            memcpy(&lookup[i], shadeColours[frame.shades[line][i] & 3], 4);
+        }
+
+        const unsigned char* indices = &frame.indices[line * FRAME_WIDTH];
+        unsigned int* out = (unsigned int*) (dest + (line - firstLine) * pitch);
+
+        for (int pixel = 0; pixel < FRAME_WIDTH; pixel++) {
+            out[pixel] = lookup[indices[pixel]];
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+#ifndef _FRAMEBUFFER_H
+#define _FRAMEBUFFER_H
+
+#include <atomic>
+
+#define FRAME_WIDTH 160
+#define FRAME_HEIGHT 144
+#define FRAME_LINE_SHADES 12
+
+// one complete frame as handed from the emulator to whoever presents it. The palettes are not applied yet,
+// each pixel is an index into the shade table of its line and ResolveFrameLines turns them into colours
+// at the last moment, straight into wherever the frame is going
+struct Frame {
+    unsigned char		indices[FRAME_WIDTH * FRAME_HEIGHT] ;		// 0-3 background, 4-7 OBP0, 8-11 OBP1
+    unsigned char		shades[FRAME_HEIGHT][FRAME_LINE_SHADES] ;	// shade of each index, 0 lightest to 3 darkest
+    unsigned long long	lineHashes[FRAME_HEIGHT] ;					// of the indices and shades of each line, see CommitLine
+    unsigned long long	frameHash ;									// of lineHashes, see Publish
+    unsigned long long	sequence ;									// how many frames were published before this one
+    int					dirtyFirstLine ;							// lines that differ from the previous frame, -1 if none
+    int					dirtyLastLine ;
+};
+
+// triple buffered framebuffer. The PPU draws into the back frame and publishes it at V-Blank by swapping it
+// with the ready frame. The consumer swaps the ready frame with its front frame when it wants to present.
+// Both swaps are a single atomic exchange so neither side ever waits for the other and the front frame is
+// always a complete frame
+class FrameBuffer {
+  public:
+    FrameBuffer					(void) ;
+    ~FrameBuffer				(void) ;
+
+    // producer side
+    void				Clear				( ) ;
+    unsigned char*		GetBackLine			( int line ) ;
+    unsigned char*		GetBackShades		( int line ) ;
+    void				CommitLine			( int line ) ;
+    void				Publish				( ) ;
+    unsigned long long	GetPublishedHash	( ) const {
+        return m_PublishedHash ;
+    }
+    // the frame the last Publish handed over. The consumer may take it at any time but only reads it, so it
+    // stays as it is until the next frame has been drawn and published
+    const Frame&		GetPublishedFrame	( ) const {
+        return m_Frames[m_PublishedFrame] ;
+    }
+    unsigned long long	GetPublishedLineHash( int line ) const {
+        return m_PublishedLineHashes[line] ;
+    }
+
+    // consumer side
+    bool				AcquireFrame		( ) ;
+    const Frame&		GetFrontFrame		( ) const {
+        return m_Frames[m_Front] ;
+    }
+    bool				GetDirtyLines		( int& firstLine, int& lastLine ) const ;
+
+  private:
+    enum {
+        INDEX_MASK = 3,
+        FRESH_BIT = 4
+    };
+
+    Frame				m_Frames[3] ;
+
+    // only touched by the producer
+    int					m_Back ;
+    unsigned long long	m_LineHashes[FRAME_HEIGHT] ;
+    bool				m_LineDirty[FRAME_HEIGHT] ;
+    unsigned long long	m_Published ;
+    int					m_PublishedFrame ;
+    unsigned long long	m_PublishedHash ;
+    unsigned long long	m_PublishedLineHashes[FRAME_HEIGHT] ;
+
+    // only touched by the consumer
+    int					m_Front ;
+    unsigned long long	m_LastSequence ;
+    bool				m_FramesDropped ;
+
+    // index of the ready frame, plus FRESH_BIT if the consumer has not taken it yet
+    std::atomic<int>	m_Ready ;
+};
+
+// BGRA bytes of a shade, 0 lightest to 3 darkest
+const unsigned char* GetShadeColour( int shade ) ;
+
+// writes lines firstLine to lastLine of a frame as BGRA (the layout of SDL_PIXELFORMAT_ARGB8888). dest is
+// where firstLine goes and pitch is the number of bytes from one line to the next
+void ResolveFrameLines( const Frame& frame, int firstLine, int lastLine, unsigned char* dest, int pitch ) ;
+
+// XXH64 of length bytes, the same as the reference implementation. The frame and line hashes are built from
+// it: each line is the 160 indices hashed with the 12 shades' hash (seed 0) as the seed, and the frame is the
+// 144 line hashes as 8 little endian bytes each, seed 0
+unsigned long long HashBytes( const unsigned char* data, int length, unsigned long long seed ) ;
+
+#endif
@@ -0,0 +1,206 @@
+#include "Config.h"
+#include "FramePacer.h"
+
+#include <chrono>
+#include <thread>
+
+#ifdef WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#endif
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+// more than this far behind and the pacer gives up catching up, e.g. after the window was dragged
+#define PACER_MAX_LATENESS (100 * 1000000ULL)
+
+// the spin before a deadline adapts to how late the sleeps wake up, within these limits
+#define PACER_MIN_SPIN (100 * 1000ULL)
+#define PACER_MAX_SPIN (4 * 1000000ULL)
+
+// how much sound the pacer tries to keep waiting to be played, in milliseconds. Enough to cover a late
+// wake up and a frame's worth of samples
+#define PACER_AUDIO_LATENCY 50
+
+// the most the sample rate is adjusted by to keep to that, either way
+#define PACER_MAX_RATE_ADJUST 0.005
+
+// how long each speed measurement lasts
+#define PACER_SPEED_INTERVAL (500 * 1000000ULL)
+
+//////////////////////////////////////////////////////////////////
+
+FramePacer::FramePacer(void) :
+    m_AudioSync(false)
+    ,m_Turbo(false)
+    ,m_RefreshRate(60)
+    ,m_Deadline(0)
+    ,m_DeadlineFraction(0)
+    ,m_AudioQueued(0)
+    ,m_AudioSampleRate(0)
+    ,m_AudioRateAdjust(1.0)
+    ,m_SpinTime(PACER_MAX_SPIN / 2)
+    ,m_SpeedStart(0)
+    ,m_SpeedCycles(0)
+    ,m_Speed(1.0) {
+#ifdef WIN32
+    // without this a sleep can last up to 15.6ms
+    timeBeginPeriod(1);
+#endif
+    Reset();
+}
+
+//////////////////////////////////////////////////////////////////
+
+FramePacer::~FramePacer(void) {
+#ifdef WIN32
+    timeEndPeriod(1);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////
+
+void FramePacer::Reset( ) {
+    m_Deadline = GetTime();
+    m_DeadlineFraction = 0;
+
+    m_SpeedStart = m_Deadline;
+    m_SpeedCycles = 0;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void FramePacer::SetRefreshRate(int refreshRate) {
+    m_RefreshRate = refreshRate > 0 ? refreshRate : 60;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void FramePacer::SetAudioSync(bool enabled) {
+    m_AudioSync = enabled;
+    Reset();
+}
+
+//////////////////////////////////////////////////////////////////
+
+void FramePacer::SetTurbo(bool enabled) {
+    m_Turbo = enabled;
+    Reset();
+}
+
+//////////////////////////////////////////////////////////////////
+
+void FramePacer::WaitForFrame( ) {
+    if (m_Turbo) {
+        return;
+    }
+
+    // the queue running down is the timer, and it doesn't matter when exactly the sleep ends
+    if (m_AudioSync && m_AudioSampleRate > 0) {
+        int excess = m_AudioQueued - GetAudioTarget();
+        if (excess > 0) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(excess * NANOSECONDS_PER_SECOND / m_AudioSampleRate));
+        }
+        return;
+    }
+
+    unsigned long long now = GetTime();
+
+    if (now > m_Deadline + PACER_MAX_LATENESS) {
+        Reset();
+        return;
+    }
+
+    if (now < m_Deadline) {
+        SleepUntil(m_Deadline);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the adjustment is in proportion to how far the queue is from the target, all of it when the queue is empty
+// or twice the target
+void FramePacer::SetAudioQueue(int queuedSamples, int sampleRate) {
+    m_AudioQueued = queuedSamples;
+    m_AudioSampleRate = sampleRate;
+
+    int target = GetAudioTarget();
+    if (target <= 0) {
+        m_AudioRateAdjust = 1.0;
+        return;
+    }
+
+    double error = (double) (target - queuedSamples) / target;
+    if (error > 1.0) {
+        error = 1.0;
+    } else if (error < -1.0) {
+        error = -1.0;
+    }
+    m_AudioRateAdjust = 1.0 + PACER_MAX_RATE_ADJUST * error;
+}
+
+//////////////////////////////////////////////////////////////////
+
+int FramePacer::GetAudioTarget( ) const {
+    return m_AudioSampleRate * PACER_AUDIO_LATENCY / 1000;
+}
+
+//////////////////////////////////////////////////////////////////
+
+bool FramePacer::AddCycles(int cycles) {
+    m_DeadlineFraction += (unsigned long long) cycles * NANOSECONDS_PER_SECOND;
+    m_Deadline += m_DeadlineFraction / GAMEBOY_CLOCK_HZ;
+    m_DeadlineFraction %= GAMEBOY_CLOCK_HZ;
+
+    m_SpeedCycles += cycles;
+
+    unsigned long long now = GetTime();
+    if (now - m_SpeedStart < PACER_SPEED_INTERVAL) {
+        return false;
+    }
+
+    m_Speed = (double) m_SpeedCycles * NANOSECONDS_PER_SECOND / (now - m_SpeedStart) / GAMEBOY_CLOCK_HZ;
+    m_SpeedStart = now;
+    m_SpeedCycles = 0;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the speed was measured with the current frame skip, but drawing is a small part of a frame so it is close
+// enough to aim the next period at
+int FramePacer::GetTurboFramePeriod( ) const {
+    int period = (int) (m_Speed * GAMEBOY_FRAME_RATE / m_RefreshRate + 0.5);
+    return period < 1 ? 1 : period;
+}
+
+//////////////////////////////////////////////////////////////////
+
+unsigned long long FramePacer::GetTime( ) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//////////////////////////////////////////////////////////////////
+
+// sleeps for most of the wait and spins for the rest, the OS can't be trusted to wake up on time
+void FramePacer::SleepUntil(unsigned long long deadline) {
+    unsigned long long now = GetTime();
+
+    if (deadline > now + m_SpinTime) {
+        unsigned long long target = deadline - m_SpinTime;
+        std::this_thread::sleep_for(std::chrono::nanoseconds(target - now));
+
+        // keep enough spin to cover the worst recent oversleep, and let it shrink back slowly
+        now = GetTime();
+        unsigned long long late = now > target ? now - target : 0;
+        unsigned long long spin = m_SpinTime - m_SpinTime / 16;
+        if (late + PACER_MIN_SPIN > spin) {
+            spin = late + PACER_MIN_SPIN;
+        }
+        m_SpinTime = spin > PACER_MAX_SPIN ? PACER_MAX_SPIN : spin;
+    }
+
+    while (GetTime() < deadline) {
+        std::this_thread::yield();
+    }
+}
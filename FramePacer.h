@@ -0,0 +1,93 @@
+#pragma once
+#ifndef _FRAMEPACER_H
+#define _FRAMEPACER_H
+
+// the real hardware clock and frame length, 4194304 / 70224 = 59.7275 frames a second
+#define GAMEBOY_CLOCK_HZ 4194304
+#define GAMEBOY_FRAME_CYCLES 70224
+#define GAMEBOY_FRAME_RATE ((double) GAMEBOY_CLOCK_HZ / GAMEBOY_FRAME_CYCLES)
+
+// keeps emulation at the real hardware speed. Every emulated cycle moves the deadline for the next frame on
+// by exactly 1 / GAMEBOY_CLOCK_HZ seconds, so rounding never builds up and the long run rate is exact.
+//
+// Normally the pacer sleeps until the deadline itself. Vsync doesn't come into it, frames are presented on
+// another thread that never holds up the one being paced.
+//
+// With audio sync it is the sound card that keeps time. The pacer sleeps while more than its target is waiting
+// to be played, and the emulation runs at whatever rate the card takes samples.
+//
+// The sound card's clock never quite agrees with the others, so in every mode the pacer also works out a small
+// adjustment (at most 0.5%) to how many samples a frame should make. That keeps the queue near its target and
+// away from running dry.
+//
+// In turbo there is no waiting at all and the pacer suggests how many frames to skip so the ones that are
+// drawn still come at about the display rate
+class FramePacer {
+  public:
+    FramePacer					(void) ;
+    ~FramePacer					(void) ;
+
+    // the next frame is due straight away
+    void				Reset				( ) ;
+
+    // the display's refresh rate, 0 if it isn't known. Only turbo uses it
+    void				SetRefreshRate		( int refreshRate ) ;
+    void				SetAudioSync		( bool enabled ) ;
+    bool				IsAudioSyncEnabled	( ) const {
+        return m_AudioSync ;
+    }
+    void				SetTurbo			( bool enabled ) ;
+    bool				IsTurboEnabled		( ) const {
+        return m_Turbo ;
+    }
+
+    // returns when it is time to emulate the next frame, straight away in turbo
+    void				WaitForFrame		( ) ;
+
+    // tell the pacer how many samples are waiting to be played, before each WaitForFrame
+    void				SetAudioQueue		( int queuedSamples, int sampleRate ) ;
+
+    // how many samples the pacer tries to keep waiting
+    int					GetAudioTarget		( ) const ;
+
+    // how much to stretch the sound by, see Apu::SetRateAdjust
+    double				GetAudioRateAdjust	( ) const {
+        return m_AudioRateAdjust ;
+    }
+
+    // tell the pacer how much the emulator has just run. Returns true when there is a new speed measurement
+    bool				AddCycles			( int cycles ) ;
+
+    // how fast emulation ran over the last measurement, as a multiple of real time
+    double				GetSpeed			( ) const {
+        return m_Speed ;
+    }
+
+    // in turbo, out of how many frames one should be drawn to keep to the display rate at the current speed
+    int					GetTurboFramePeriod	( ) const ;
+
+    // monotonic clock in nanoseconds
+    static unsigned long long	GetTime			( ) ;
+
+  private:
+    void				SleepUntil			( unsigned long long deadline ) ;
+
+    bool				m_AudioSync ;
+    bool				m_Turbo ;
+    int					m_RefreshRate ;
+
+    unsigned long long	m_Deadline ;			// when the next frame should start, nanoseconds
+    unsigned long long	m_DeadlineFraction ;	// and the part of a nanosecond left over, in 1 / GAMEBOY_CLOCK_HZ ns
+
+    int					m_AudioQueued ;			// samples waiting to be played
+    int					m_AudioSampleRate ;
+    double				m_AudioRateAdjust ;
+
+    unsigned long long	m_SpinTime ;			// how long before the deadline to stop sleeping and spin
+
+    unsigned long long	m_SpeedStart ;			// when the current speed measurement started
+    unsigned long long	m_SpeedCycles ;			// cycles run since then
+    double				m_Speed ;
+};
+
+#endif
@@ -2,22 +2,61 @@
 #include "Emulator.h"
 #include "GameBoy.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
 #include <SDL2/SDL_syswm.h>
 
 #define ID_LOADROM 0
 #define ID_EXIT 1
 #define ID_ABOUT 2
+#define ID_FILTER_NONE 3
+#define ID_FILTER_SCALENX 4
+#define ID_LCD_GRID 5
+#define ID_LCD_GHOSTING 6
+#define ID_SCALE_1X 7 // ID_SCALE_1X + n - 1 is n times
+#define ID_SCALE_4X 10
+#define ID_RECORD_VIDEO 11
+#define ID_SCREENSHOT 12
+#define ID_VSYNC 13
+#define ID_PAUSE 14
+#define ID_TURBO 15
+#define ID_AUDIO_SYNC 16
+#define ID_RUN_AHEAD_OFF 17 // ID_RUN_AHEAD_OFF + n is n frames
+#define ID_RUN_AHEAD_3 20
+#define ID_FILTER_XBR 21
 
 static const int screenWidth = 160;
 static const int screenHeight = 144;
-static const int scale = 2;
+
+#define AUDIO_SAMPLE_RATE 48000
+
+// the pacer keeps the queue at about half this by adjusting the sample rate, if it still gets this full a
+// frame's worth is dropped rather than let the delay build up
+#define AUDIO_MAX_QUEUED (AUDIO_SAMPLE_RATE / 10)
+
+// how often the ghosting fades on when no new frames are coming, e.g. while paused, in milliseconds
+#define GHOSTING_INTERVAL 16
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
+// called on the emulation thread
 static void DoRender( ) {
-    GameBoy* gb = GameBoy::GetSingleton() ;
-    gb->RenderGame(gb->GetRenderer(), gb->GetTexture());
+    GameBoy::GetSingleton()->FramePublished();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////
+
+// SDL_PushEvent can be called from any thread and wakes up SDL_WaitEvent on the main thread
+static void PushUserEvent(Uint32 type, int code) {
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.user.code = code;
+    SDL_PushEvent(&event);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////
@@ -40,10 +79,36 @@ GameBoy* GameBoy::GetSingleton( ) {
 //////////////////////////////////////////////////////////////////////////////////////////
 
 GameBoy::GameBoy(void) :
-    m_Emulator(NULL) {
+    m_Emulator(NULL)
+    ,m_texture(NULL)
+    ,m_FileMenu(NULL)
+    ,m_VideoMenu(NULL)
+    ,m_FilterInput(screenWidth * screenHeight * 4)
+    ,m_AudioDevice(0)
+    ,m_FrameEvent(0)
+    ,m_SpeedEvent(0)
+    ,m_RomLoaded(false)
+    ,m_Paused(false)
+    ,m_Turbo(false)
+    ,m_Vsync(false)
+    ,m_AudioSync(false)
+    ,m_Speed(0)
+    ,m_FilterSettled(true)
+    ,m_EmulationThread(NULL)
+    ,m_StopEmulation(false)
+    ,m_FrameEventPending(false)
+    ,m_TurboFramePeriod(1)
+    ,m_RunAhead(0)
+    ,m_InputTicks(0)
+    ,m_InputCycles(0) {
     m_Emulator = new Emulator(false);
     m_Emulator->SetRenderFunc(DoRender);
 
+    // with cores to spare the scanlines are drawn off the emulation thread
+    if (std::thread::hardware_concurrency() >= 4) {
+        m_Emulator->SetRenderThread(true);
+    }
+
     if (!CreateSDLWindow()) {
         MessageBox(NULL, TEXT("SDL window cannot be created."), TEXT("Error"), MB_OK | MB_ICONERROR);
         std::exit(1);
@@ -64,25 +129,29 @@ SDL_Texture *GameBoy::GetTexture() {
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-void GameBoy::Initialize(char *romFile) {
-    m_Emulator->LoadRom(romFile);
+// false if the ROM couldn't be loaded, the emulator then has no game at all
+bool GameBoy::Initialize(char *romFile) {
+    return m_Emulator->LoadRom(romFile);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
+// the main thread only handles events and presents frames, the emulation runs on its own thread (see
+// EmulationThreadMain) so a present that is held up by vsync or the compositor never holds up the game. The
+// emulation thread sends an event when it publishes a frame, so this sleeps until there is something to do.
+// The ghosting is the exception, it keeps fading until it has caught up with the frame on screen
 void GameBoy::StartEmulation( ) {
-    bool bFirstTime = true;
-    bool bROMLoaded = false;
     bool quit = false;
     SDL_Event evt;
-
-    float fps = 59.73 ;
-    float interval = 1000 ;
-    interval /= fps ;
-
-    unsigned int time2;
+    Uint32 renderTicks = 0;	// when the frame on screen was last drawn
 
     while (!quit) {
-        while (SDL_PollEvent(&evt) != 0) {
+        // other events don't speed the ghosting up, it steps at most once every GHOSTING_INTERVAL
+        Uint32 sinceRender = SDL_GetTicks() - renderTicks;
+        int ghostingWait = sinceRender < GHOSTING_INTERVAL ? (int) (GHOSTING_INTERVAL - sinceRender) : 0;
+        bool gotEvent = m_FilterSettled ? SDL_WaitEvent(&evt) != 0 : SDL_WaitEventTimeout(&evt, ghostingWait) != 0;
+        bool frameReady = false;
+
+        for (; gotEvent; gotEvent = SDL_PollEvent(&evt) != 0) {
             switch (evt.type) {
             case SDL_SYSWMEVENT:
                 switch (evt.syswm.msg->msg.win.msg) {
@@ -102,23 +171,83 @@ void GameBoy::StartEmulation( ) {
                         ofn.lpstrDefExt = "gb";
 
                         if(GetOpenFileName(&ofn)) {
-                            Initialize(szFileName);
-                            bROMLoaded = true;
-                            bFirstTime = true;
+                            StopEmulationThread();
+                            m_RomLoaded = Initialize(szFileName);
+                            if (!m_RomLoaded) {
+                                MessageBox(hWnd, TEXT("The ROM cannot be loaded."), TEXT("Error"), MB_OK | MB_ICONERROR);
+                            } else if (m_Paused) {
+                                SetPaused(false);
+                            } else {
+                                StartEmulationThread();
+                            }
                         }
                         break;
                     }
+                    case ID_RECORD_VIDEO:
+                        ToggleRecording();
+                        break;
+                    case ID_SCREENSHOT:
+                        SaveScreenshot();
+                        break;
+                    case ID_PAUSE:
+                        SetPaused(!m_Paused);
+                        break;
+                    case ID_TURBO:
+                        SetTurbo(!m_Turbo);
+                        break;
                     case ID_EXIT:
                         quit = true;
                         break;
                     case ID_ABOUT:
                         MessageBox(hWnd, TEXT("um..."), TEXT("About IronBoy"), MB_ICONINFORMATION | MB_OK);
                         break;
+                    case ID_FILTER_NONE:
+                        m_Filter.SetFilter(FILTER_NONE);
+                        ApplyVideoSettings();
+                        break;
+                    case ID_FILTER_SCALENX:
+                        m_Filter.SetFilter(FILTER_SCALENX);
+                        ApplyVideoSettings();
+                        break;
+                    case ID_FILTER_XBR:
+                        m_Filter.SetFilter(FILTER_XBR);
+                        ApplyVideoSettings();
+                        break;
+                    case ID_LCD_GRID:
+                        m_Filter.SetGrid(!m_Filter.IsGridEnabled());
+                        ApplyVideoSettings();
+                        break;
+                    case ID_LCD_GHOSTING:
+                        m_Filter.SetGhosting(!m_Filter.IsGhostingEnabled());
+                        ApplyVideoSettings();
+                        break;
+                    case ID_VSYNC:
+                        SetVsync(!m_Vsync);
+                        break;
+                    case ID_AUDIO_SYNC:
+                        SetAudioSync(!m_AudioSync);
+                        break;
+                    default: {
+                        int id = LOWORD(evt.syswm.msg->msg.win.wParam);
+                        if (id >= ID_SCALE_1X && id <= ID_SCALE_4X) {
+                            m_Filter.SetScale(id - ID_SCALE_1X + 1);
+                            ApplyVideoSettings();
+                        } else if (id >= ID_RUN_AHEAD_OFF && id <= ID_RUN_AHEAD_3) {
+                            SetRunAhead(id - ID_RUN_AHEAD_OFF);
+                        }
+                        break;
+                    }
                     }
                     break;
                 }
                 break;
                 break;
+            case SDL_WINDOWEVENT:
+                // the texture still holds the last frame, show it again when the window needs repainting
+                if (evt.window.event == SDL_WINDOWEVENT_EXPOSED || evt.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    PresentGame(m_renderer, m_texture);
+                }
+                break;
             case SDL_WINDOWEVENT_CLOSE:
                 evt.type = SDL_QUIT;
                 SDL_PushEvent(&evt);
@@ -127,34 +256,174 @@ void GameBoy::StartEmulation( ) {
                 quit = true;
                 break;
             default:
-                HandleInput(evt);
+                if (evt.type == m_FrameEvent) {
+                    frameReady = true;
+                } else if (evt.type == m_SpeedEvent) {
+                    m_Speed = evt.user.code / 10.0;
+                    UpdateWindowTitle();
+                } else {
+                    HandleInput(evt);
+                }
                 break;
             }
         }
 
-        if (bROMLoaded) {
-            if (bFirstTime) {
-                time2 = SDL_GetTicks();
-                bFirstTime = false;
-            }
+        // only the newest frame is drawn however many were published since the last one
+        if (frameReady) {
+            m_FrameEventPending.exchange(false, std::memory_order_acq_rel);
+            RenderGame(m_renderer, m_texture);
+            renderTicks = SDL_GetTicks();
+        } else if (!m_FilterSettled && SDL_GetTicks() - renderTicks >= GHOSTING_INTERVAL) {
+            RenderGame(m_renderer, m_texture);
+            renderTicks = SDL_GetTicks();
+        }
+    }
 
-            unsigned int current = SDL_GetTicks( ) ;
+    StopEmulationThread();
+}
 
-            if( (time2 + interval) < current ) {
-                m_Emulator->Update();
-                time2 = current ;
-            }
-        } else {
-            DoRender();
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void GameBoy::StartEmulationThread( ) {
+    if (m_EmulationThread == NULL) {
+        m_StopEmulation.store(false, std::memory_order_relaxed);
+        m_EmulationThread = new std::thread(&GameBoy::EmulationThreadMain, this);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// waits for the frame being emulated to finish. Returns whether the thread was running, while it is stopped
+// the main thread can use the emulator, the pacer and the recorder
+bool GameBoy::StopEmulationThread( ) {
+    if (m_EmulationThread == NULL) {
+        return false;
+    }
+
+    m_StopEmulation.store(true, std::memory_order_release);
+    m_EmulationThread->join();
+    delete m_EmulationThread;
+    m_EmulationThread = NULL;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the emulation thread owns the emulator and the pacer while it runs, the main thread only talks to it through
+// m_Commands. Frames go back the other way through the emulator's triple buffered FrameBuffer, so neither
+// thread ever waits for the other
+void GameBoy::EmulationThreadMain( ) {
+    // the time spent stopped shouldn't be caught up afterwards
+    m_Pacer.Reset();
+
+    while (!m_StopEmulation.load(std::memory_order_acquire)) {
+        if (m_AudioDevice) {
+            m_Pacer.SetAudioQueue(SDL_GetQueuedAudioSize(m_AudioDevice) / 4, AUDIO_SAMPLE_RATE);
+        }
+
+        m_Pacer.WaitForFrame();
+
+        // as late as possible, so the frame gets any input that came in while the pacer was waiting
+        EmulationCommand command;
+        while (m_Commands.Pop(command)) {
+            ApplyCommand(command);
+        }
+
+        Uint32 updateTicks = SDL_GetTicks();
+        m_Emulator->Update();
+
+        // input that arrives while this frame is on screen goes into the next one the same distance in
+        m_InputTicks = updateTicks;
+        m_InputCycles = m_Emulator->GetTotalCycles();
+
+        QueueAudio();
+        if (m_Pacer.AddCycles(m_Emulator->GetCyclesThisUpdate()) && m_Pacer.IsTurboEnabled()) {
+            UpdateTurbo();
         }
     }
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// from the main thread. Goes straight to the emulator when its thread is stopped, otherwise the thread picks
+// it up before its next frame
+void GameBoy::SendCommand(int type, int value, Uint32 timestamp) {
+    EmulationCommand command;
+    command.type = type;
+    command.value = value;
+    command.timestamp = timestamp;
+
+    if (m_EmulationThread == NULL) {
+        ApplyCommand(command);
+        return;
+    }
+
+    // the thread empties the queue every frame, it is only ever full if that frame is taking a long time
+    while (!m_Commands.Push(command)) {
+        std::this_thread::yield();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// on whichever thread owns the emulator
+void GameBoy::ApplyCommand(const EmulationCommand& command) {
+    switch (command.type) {
+    case COMMAND_KEY_DOWN:
+    case COMMAND_KEY_UP:
+        QueueKey(command.value, command.type == COMMAND_KEY_DOWN, command.timestamp);
+        break;
+    case COMMAND_TURBO:
+        m_Pacer.SetTurbo(command.value != 0);
+
+        // start from no skipping, the first measurement puts it right
+        m_TurboFramePeriod = 1;
+        m_Emulator->SetFrameSkip(1, 1);
+
+        // nobody can react to a frame in turbo, running ahead would only slow it down
+        m_Emulator->SetRunAhead(command.value ? 0 : m_RunAhead);
+        break;
+    case COMMAND_AUDIO_SYNC:
+        m_Pacer.SetAudioSync(command.value != 0);
+        break;
+    case COMMAND_RUN_AHEAD:
+        m_RunAhead = command.value;
+        if (!m_Pacer.IsTurboEnabled()) {
+            m_Emulator->SetRunAhead(m_RunAhead);
+        }
+        break;
+    case COMMAND_REFRESH_RATE:
+        m_Pacer.SetRefreshRate(command.value);
+        break;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// on the emulation thread, straight after a frame is published. The frame is not touched again until another
+// one has been drawn, so the recorder can copy it from here and get every frame, even those that are never
+// presented. The main thread is only woken if it hasn't already been told about an earlier frame
+void GameBoy::FramePublished( ) {
+    if (m_Recorder.IsRecording()) {
+        m_Recorder.AddFrame(m_Emulator->GetFrameBuffer()->GetPublishedFrame());
+    }
+
+    if (!m_FrameEventPending.exchange(true, std::memory_order_acq_rel)) {
+        PushUserEvent(m_FrameEvent, 0);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 GameBoy::~GameBoy(void) {
+    StopEmulationThread();
+    m_Recorder.Stop();
     delete m_Emulator ;
 
+    if (m_AudioDevice) {
+        SDL_CloseAudioDevice(m_AudioDevice);
+    }
+
     SDL_DestroyTexture(m_texture);
     m_texture = NULL;
 
@@ -170,23 +439,300 @@ GameBoy::~GameBoy(void) {
 //////////////////////////////////////////////////////////////////////////////////////////
 
 void GameBoy::RenderGame(SDL_Renderer *renderer, SDL_Texture *texture) {
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-    SDL_UpdateTexture(texture, NULL, &m_Emulator->m_ScreenData[0], screenWidth * 4);
+    FrameBuffer* frameBuffer = m_Emulator->GetFrameBuffer();
+    int firstLine;
+    int lastLine;
+
+    // nothing new was published, or the new frame is identical to the one on screen. Unless the ghosting
+    // hasn't caught up with it yet, then the same frame is filtered again
+    bool changed = frameBuffer->AcquireFrame() && frameBuffer->GetDirtyLines(firstLine, lastLine);
+    if (!changed && m_FilterSettled) {
+        return;
+    }
+
+    const Frame& frame = frameBuffer->GetFrontFrame();
+
+    if (m_Filter.IsPassThrough()) {
+        DrawFrameLines(texture, frame, firstLine, lastLine);
+    } else {
+        DrawFilteredFrame(texture, frame);
+    }
+
+    PresentGame(renderer, texture);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the palettes are applied straight into the locked texture. Only the rows that changed are locked, the
+// rest of the texture still holds the previous frame
+void GameBoy::DrawFrameLines(SDL_Texture *texture, const Frame& frame, int firstLine, int lastLine) {
+    SDL_Rect dirty = { 0, firstLine, screenWidth, lastLine - firstLine + 1 };
+    void* pixels;
+    int pitch;
+
+    if (SDL_LockTexture(texture, &dirty, &pixels, &pitch) != 0) {
+        return;
+    }
+
+    ResolveFrameLines(frame, firstLine, lastLine, (unsigned char*) pixels, pitch);
+
+    SDL_UnlockTexture(texture);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the filter needs the colours of the whole frame, but still writes straight into the texture so every
+// filtered pixel is only written once
+void GameBoy::DrawFilteredFrame(SDL_Texture *texture, const Frame& frame) {
+    void* pixels;
+    int pitch;
+
+    ResolveFrameLines(frame, 0, screenHeight - 1, &m_FilterInput[0], screenWidth * 4);
+
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
+        return;
+    }
+
+    m_FilterSettled = m_Filter.Apply(&m_FilterInput[0], (unsigned char*) pixels, pitch);
+
+    SDL_UnlockTexture(texture);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// called whenever the filter, LCD effects or scale change. Without any filtering the texture stays at the
+// Game Boy resolution and the renderer stretches it, otherwise the filter output is already window sized
+void GameBoy::ApplyVideoSettings( ) {
+    int scale = m_Filter.GetScale();
+    int textureScale = m_Filter.IsPassThrough() ? 1 : scale;
+
+    if (m_texture) {
+        SDL_DestroyTexture(m_texture);
+    }
+
+    m_texture = SDL_CreateTexture(m_renderer,
+                                  SDL_PIXELFORMAT_ARGB8888,
+                                  SDL_TEXTUREACCESS_STREAMING,
+                                  screenWidth * textureScale,
+                                  screenHeight * textureScale);
+
+    if (m_texture == NULL) {
+        LogMessage::GetSingleton()->DoLogMessage("Could not create the screen texture", true);
+        return;
+    }
+
+    SDL_SetWindowSize(m_window, screenWidth * scale, screenHeight * scale);
+
+    CheckMenuItem(m_VideoMenu, ID_FILTER_NONE, m_Filter.GetFilter() == FILTER_NONE ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(m_VideoMenu, ID_FILTER_SCALENX, m_Filter.GetFilter() == FILTER_SCALENX ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(m_VideoMenu, ID_FILTER_XBR, m_Filter.GetFilter() == FILTER_XBR ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(m_VideoMenu, ID_LCD_GRID, m_Filter.IsGridEnabled() ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(m_VideoMenu, ID_LCD_GHOSTING, m_Filter.IsGhostingEnabled() ? MF_CHECKED : MF_UNCHECKED);
+    for (int id = ID_SCALE_1X; id <= ID_SCALE_4X; id++) {
+        CheckMenuItem(m_VideoMenu, id, id - ID_SCALE_1X + 1 == scale ? MF_CHECKED : MF_UNCHECKED);
+    }
+
+    // the new texture is empty, fill it with the frame that is on screen now. Any ghosting starts again
+    const Frame& frame = m_Emulator->GetFrameBuffer()->GetFrontFrame();
+    m_FilterSettled = true;
+
+    if (m_Filter.IsPassThrough()) {
+        DrawFrameLines(m_texture, frame, 0, screenHeight - 1);
+    } else {
+        DrawFilteredFrame(m_texture, frame);
+    }
+
+    PresentGame(m_renderer, m_texture);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// pausing stops the emulation thread, the screen is then only redrawn when the window needs it
+void GameBoy::SetPaused(bool paused) {
+    m_Paused = paused;
+
+    if (paused) {
+        StopEmulationThread();
+    } else if (m_RomLoaded) {
+        StartEmulationThread();
+    }
+
+    if (m_AudioDevice) {
+        SDL_PauseAudioDevice(m_AudioDevice, paused ? 1 : 0);
+    }
+
+    UpdateWindowTitle();
+    CheckMenuItem(m_FileMenu, ID_PAUSE, paused ? MF_CHECKED : MF_UNCHECKED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// runs as fast as the host can, skipping frames so the screen still only updates at the display rate
+void GameBoy::SetTurbo(bool enabled) {
+    m_Turbo = enabled;
+    m_Speed = 0;
+    SendCommand(COMMAND_TURBO, enabled ? 1 : 0, 0);
+
+    UpdateWindowTitle();
+    CheckMenuItem(m_FileMenu, ID_TURBO, enabled ? MF_CHECKED : MF_UNCHECKED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// called on the emulation thread with each new speed measurement while in turbo. The window belongs to the
+// main thread, it gets the speed as an event
+void GameBoy::UpdateTurbo( ) {
+    int period = m_Pacer.GetTurboFramePeriod();
+    if (period != m_TurboFramePeriod) {
+        m_TurboFramePeriod = period;
+        m_Emulator->SetFrameSkip(1, period);
+    }
+
+    PushUserEvent(m_SpeedEvent, (int) (m_Pacer.GetSpeed() * 10 + 0.5));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void GameBoy::UpdateWindowTitle( ) {
+    char title[64] = "IronBoy";
+
+    if (m_Paused) {
+        strcat(title, " - Paused");
+    } else if (m_Turbo && m_Speed > 0) {
+        sprintf(title + strlen(title), " - Turbo %.1fx", m_Speed);
+    } else if (m_Turbo) {
+        strcat(title, " - Turbo");
+    }
+
+    SDL_SetWindowTitle(m_window, title);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// presents without tearing. It only holds up the main thread, the emulation keeps to its own pace and the newest
+// frame is shown at each refresh
+void GameBoy::SetVsync(bool enabled) {
+    if (SDL_RenderSetVSync(m_renderer, enabled ? 1 : 0) != 0) {
+        LogMessage::GetSingleton()->DoLogMessage("The renderer can't change vsync", false);
+        enabled = false;
+    }
+    m_Vsync = enabled;
+
+    // the window may have moved to another display since it was created
+    SDL_DisplayMode mode;
+    SendCommand(COMMAND_REFRESH_RATE, SDL_GetWindowDisplayMode(m_window, &mode) == 0 ? mode.refresh_rate : 0, 0);
+
+    CheckMenuItem(m_VideoMenu, ID_VSYNC, enabled ? MF_CHECKED : MF_UNCHECKED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the sound card's clock paces emulation instead of the timer, for lower and steadier sound latency
+void GameBoy::SetAudioSync(bool enabled) {
+    if (enabled && m_AudioDevice == 0) {
+        LogMessage::GetSingleton()->DoLogMessage("There is no sound device to sync to", false);
+        enabled = false;
+    }
+
+    m_AudioSync = enabled;
+    SendCommand(COMMAND_AUDIO_SYNC, enabled ? 1 : 0, 0);
+    CheckMenuItem(m_VideoMenu, ID_AUDIO_SYNC, enabled ? MF_CHECKED : MF_UNCHECKED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// each frame of run-ahead takes a frame of input lag away, and costs another frame of emulation
+void GameBoy::SetRunAhead(int frames) {
+    SendCommand(COMMAND_RUN_AHEAD, frames, 0);
+
+    for (int id = ID_RUN_AHEAD_OFF; id <= ID_RUN_AHEAD_3; id++) {
+        CheckMenuItem(m_FileMenu, id, id - ID_RUN_AHEAD_OFF == frames ? MF_CHECKED : MF_UNCHECKED);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the emulation thread adds the frames, it is stopped while the recorder starts or stops
+void GameBoy::ToggleRecording( ) {
+    if (m_Recorder.IsRecording()) {
+        bool running = StopEmulationThread();
+        m_Recorder.Stop();
+        if (running) {
+            StartEmulationThread();
+        }
+    } else {
+        OPENFILENAME ofn;
+        char szFileName[MAX_PATH] = "";
+        ZeroMemory(&ofn, sizeof(ofn));
+
+        ofn.lStructSize = sizeof(ofn);
+        ofn.hwndOwner = hWnd;
+        ofn.lpstrFilter = "Y4M video (*.y4m)\0*.y4m\0Lossless delta (*.gbv)\0*.gbv\0";
+        ofn.lpstrFile = szFileName;
+        ofn.nMaxFile = MAX_PATH;
+        ofn.Flags = OFN_EXPLORER | OFN_OVERWRITEPROMPT | OFN_HIDEREADONLY;
+        ofn.lpstrDefExt = "y4m";
+
+        if (GetSaveFileName(&ofn)) {
+            bool running = StopEmulationThread();
+            m_Recorder.Start(szFileName, ofn.nFilterIndex == 2 ? VIDEO_DELTA_RLE : VIDEO_Y4M);
+            if (running) {
+                StartEmulationThread();
+            }
+        }
+    }
+
+    CheckMenuItem(m_FileMenu, ID_RECORD_VIDEO, m_Recorder.IsRecording() ? MF_CHECKED : MF_UNCHECKED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// saves the frame on screen next to the executable, the encoding happens on the screenshot thread
+void GameBoy::SaveScreenshot( ) {
+    const Frame& frame = m_Emulator->GetFrameBuffer()->GetFrontFrame();
+
+    char fileName[64];
+    time_t now = time(NULL);
+    size_t length = strftime(fileName, sizeof(fileName), "IronBoy_%Y%m%d_%H%M%S", localtime(&now));
+    sprintf(fileName + length, "_%llu.png", frame.sequence);
+
+    if (!m_Screenshots.Capture(frame, fileName)) {
+        LogMessage::GetSingleton()->DoLogMessage("Too many screenshots waiting to be saved, skipped one", false);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the texture is stretched over the whole window so there is nothing to clear first
+void GameBoy::PresentGame(SDL_Renderer *renderer, SDL_Texture *texture) {
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-void GameBoy::SetKeyPressed(int key) {
-    m_Emulator->KeyPressed(key) ;
+// on the emulation thread. SDL stamps each event with when it happened, so a press keeps its place in the frame
+// however late it gets here. Everything is a frame behind, as it was when input only changed between updates, but
+// two presses a few milliseconds apart are still a few milliseconds apart in the game
+void GameBoy::QueueKey(int key, bool pressed, Uint32 timestamp) {
+    unsigned long long cycles = 0;
+    if ((Sint32) (timestamp - m_InputTicks) > 0) {
+        cycles = (unsigned long long) (timestamp - m_InputTicks) * GAMEBOY_CLOCK_HZ / 1000;
+    }
+
+    m_Emulator->QueueInput(key, pressed, m_InputCycles + std::min(cycles, (unsigned long long) GAMEBOY_FRAME_CYCLES - 1));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void GameBoy::SetKeyPressed(int key, Uint32 timestamp) {
+    SendCommand(COMMAND_KEY_DOWN, key, timestamp) ;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-void GameBoy::SetKeyReleased(int key) {
-    m_Emulator->KeyReleased(key) ;
+void GameBoy::SetKeyReleased(int key, Uint32 timestamp) {
+    SendCommand(COMMAND_KEY_UP, key, timestamp) ;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -196,11 +742,18 @@ bool GameBoy::CreateSDLWindow( ) {
         return false ;
     }
 
+    // how the emulation thread tells the main thread about a new frame or a new turbo speed
+    m_FrameEvent = SDL_RegisterEvents(2);
+    if (m_FrameEvent == (Uint32) -1) {
+        return false;
+    }
+    m_SpeedEvent = m_FrameEvent + 1;
+
     m_window = SDL_CreateWindow("IronBoy",
                                 SDL_WINDOWPOS_UNDEFINED,
                                 SDL_WINDOWPOS_UNDEFINED,
-                                screenWidth * scale,
-                                screenHeight * scale,
+                                screenWidth * m_Filter.GetScale(),
+                                screenHeight * m_Filter.GetScale(),
                                 SDL_WINDOW_SHOWN);
 
     if (m_window == NULL) {
@@ -223,6 +776,9 @@ bool GameBoy::CreateSDLWindow( ) {
         return false;
     }
 
+    // the window can be exposed before any frame is drawn, start it off blank
+    DrawFrameLines(m_texture, m_Emulator->GetFrameBuffer()->GetFrontFrame(), 0, screenHeight - 1);
+
     SDL_SysWMinfo info;
     SDL_VERSION(&info.version);
 
@@ -233,27 +789,112 @@ bool GameBoy::CreateSDLWindow( ) {
     hWnd = info.info.win.window;
 
     HMENU hMenuBar = CreateMenu();
-    HMENU hFile = CreatePopupMenu();
+    m_FileMenu = CreatePopupMenu();
+    HMENU hRunAhead = CreatePopupMenu();
     HMENU hHelp = CreatePopupMenu();
+    m_VideoMenu = CreatePopupMenu();
 
-    AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR) hFile, "File");
+    AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR) m_FileMenu, "File");
+    AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR) m_VideoMenu, "Video");
     AppendMenu(hMenuBar, MF_POPUP, (UINT_PTR) hHelp, "Help");
 
-    AppendMenu(hFile, MF_STRING, ID_LOADROM, "Load ROM");
-    AppendMenu(hFile, MF_STRING, ID_EXIT, "Exit");
+    AppendMenu(m_FileMenu, MF_STRING, ID_LOADROM, "Load ROM");
+    AppendMenu(m_FileMenu, MF_STRING, ID_PAUSE, "Pause\tP");
+    AppendMenu(m_FileMenu, MF_STRING, ID_TURBO, "Turbo\tTab");
+    AppendMenu(m_FileMenu, MF_POPUP, (UINT_PTR) hRunAhead, "Run-Ahead");
+    AppendMenu(m_FileMenu, MF_STRING, ID_SCREENSHOT, "Save Screenshot\tF12");
+    AppendMenu(m_FileMenu, MF_STRING, ID_RECORD_VIDEO, "Record Video...");
+    AppendMenu(m_FileMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(m_FileMenu, MF_STRING, ID_EXIT, "Exit");
+
+    AppendMenu(m_VideoMenu, MF_STRING | MF_CHECKED, ID_FILTER_NONE, "No Filter");
+    AppendMenu(m_VideoMenu, MF_STRING, ID_FILTER_SCALENX, "Scale2x/3x/4x");
+    AppendMenu(m_VideoMenu, MF_STRING, ID_FILTER_XBR, "xBR");
+    AppendMenu(m_VideoMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(m_VideoMenu, MF_STRING, ID_LCD_GRID, "LCD Grid");
+    AppendMenu(m_VideoMenu, MF_STRING, ID_LCD_GHOSTING, "LCD Ghosting");
+    AppendMenu(m_VideoMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(m_VideoMenu, MF_STRING, ID_SCALE_1X, "1x");
+    AppendMenu(m_VideoMenu, MF_STRING | MF_CHECKED, ID_SCALE_1X + 1, "2x");
+    AppendMenu(m_VideoMenu, MF_STRING, ID_SCALE_1X + 2, "3x");
+    AppendMenu(m_VideoMenu, MF_STRING, ID_SCALE_4X, "4x");
+    AppendMenu(m_VideoMenu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(m_VideoMenu, MF_STRING, ID_VSYNC, "VSync");
+    AppendMenu(m_VideoMenu, MF_STRING, ID_AUDIO_SYNC, "Sync to Audio");
+
+    AppendMenu(hRunAhead, MF_STRING | MF_CHECKED, ID_RUN_AHEAD_OFF, "Off");
+    AppendMenu(hRunAhead, MF_STRING, ID_RUN_AHEAD_OFF + 1, "1 Frame");
+    AppendMenu(hRunAhead, MF_STRING, ID_RUN_AHEAD_OFF + 2, "2 Frames");
+    AppendMenu(hRunAhead, MF_STRING, ID_RUN_AHEAD_3, "3 Frames");
 
     AppendMenu(hHelp, MF_STRING, ID_ABOUT, "About");
 
     SetMenu(hWnd, hMenuBar);
 
-    SDL_SetWindowSize(m_window, screenWidth * scale, screenHeight * scale); // resize because we just added the menubar
+    SDL_SetWindowSize(m_window, screenWidth * m_Filter.GetScale(), screenHeight * m_Filter.GetScale()); // resize because we just added the menubar
+
+    // turbo draws frames at about the display rate
+    SDL_DisplayMode mode;
+    m_Pacer.SetRefreshRate(SDL_GetWindowDisplayMode(m_window, &mode) == 0 ? mode.refresh_rate : 0);
     SDL_EventState(SDL_SYSWMEVENT, SDL_ENABLE);
 
+    OpenAudio();
+
     return true ;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// no sound card isn't fatal, the game just runs silently
+void GameBoy::OpenAudio( ) {
+    SDL_AudioSpec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.freq = AUDIO_SAMPLE_RATE;
+    spec.format = AUDIO_S16SYS;
+    spec.channels = 2;
+    spec.samples = 512;
+    spec.callback = NULL;
+
+    m_AudioDevice = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+    if (m_AudioDevice == 0) {
+        std::string message = std::string("Could not open the sound device: ") + SDL_GetError();
+        LogMessage::GetSingleton()->DoLogMessage(message.c_str(), false);
+        return;
+    }
+
+    m_AudioSamples.resize(AUDIO_SAMPLE_RATE / 4 * 2);
+    m_Emulator->SetAudioSampleRate(AUDIO_SAMPLE_RATE);
+    SDL_PauseAudioDevice(m_AudioDevice, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// on the emulation thread, hands the sound from the last Update to SDL which plays it from its own thread
+void GameBoy::QueueAudio( ) {
+    if (m_AudioDevice == 0) {
+        return;
+    }
+
+    int count = m_Emulator->ReadAudioSamples(&m_AudioSamples[0], (int) m_AudioSamples.size() / 2);
+    m_Emulator->SetAudioRateAdjust(m_Pacer.IsTurboEnabled() ? 1.0 : m_Pacer.GetAudioRateAdjust());
+
+    // in turbo the sound would only fall further and further behind
+    Uint32 queued = SDL_GetQueuedAudioSize(m_AudioDevice) / 4;
+    if (m_Pacer.IsTurboEnabled() || queued > AUDIO_MAX_QUEUED) {
+        return;
+    }
+
+    // starting, or after running dry, go straight to the pacer's target with silence rather than creep up to it
+    if (queued == 0 && m_Pacer.GetAudioTarget() > 0) {
+        std::vector<short> silence(m_Pacer.GetAudioTarget() * 2, 0);
+        SDL_QueueAudio(m_AudioDevice, &silence[0], (Uint32) silence.size() * 2);
+    }
+
+    SDL_QueueAudio(m_AudioDevice, &m_AudioSamples[0], count * 4);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 void GameBoy::HandleInput(SDL_Event& event) {
     if( event.type == SDL_KEYDOWN ) {
         int key = -1 ;
@@ -282,9 +923,25 @@ void GameBoy::HandleInput(SDL_Event& event) {
         case SDLK_DOWN :
             key = 3 ;
             break ;
+        case SDLK_F12 :
+            if (event.key.repeat == 0) {
+                SaveScreenshot() ;
+            }
+            break ;
+        case SDLK_p :
+            if (event.key.repeat == 0) {
+                SetPaused(!m_Paused) ;
+            }
+            break ;
+        case SDLK_TAB :
+            if (event.key.repeat == 0) {
+                SetTurbo(!m_Turbo) ;
+            }
+            break ;
         }
-        if (key != -1) {
-            SetKeyPressed(key) ;
+        // held keys repeat, but the button is already down
+        if (key != -1 && event.key.repeat == 0) {
+            SetKeyPressed(key, event.key.timestamp) ;
         }
     }
     //If a key was released
@@ -317,7 +974,7 @@ void GameBoy::HandleInput(SDL_Event& event) {
             break ;
         }
         if (key != -1) {
-            SetKeyReleased(key) ;
+            SetKeyReleased(key, event.key.timestamp) ;
         }
     }
 }
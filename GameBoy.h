@@ -5,6 +5,13 @@
 class Emulator ;
 
 #include "Emulator.h"
+#include "FramePacer.h"
+#include "RingBuffer.h"
+#include "ScreenFilter.h"
+#include "ScreenshotWriter.h"
+#include "VideoRecorder.h"
+#include <atomic>
+#include <thread>
 #include <Windows.h>
 #include <SDL2/SDL.h>
 class GameBoy {
@@ -17,15 +24,60 @@ class GameBoy {
     SDL_Renderer*           GetRenderer                 ();
     SDL_Texture*            GetTexture                  ();
     void					RenderGame					(SDL_Renderer*, SDL_Texture*);
-    void					Initialize					(char *);
-    void					SetKeyPressed				( int key ) ;
-    void					SetKeyReleased				( int key ) ;
+    void					PresentGame					(SDL_Renderer*, SDL_Texture*);
+    bool					Initialize					(char *);
+    void					SetKeyPressed				( int key, Uint32 timestamp ) ;
+    void					SetKeyReleased				( int key, Uint32 timestamp ) ;
     void					StartEmulation				( ) ;
     void					HandleInput					( SDL_Event& event ) ;
+    // uncapped speed, see FramePacer. GetSpeed is the multiple of real time emulation is running at
+    void					SetTurbo					( bool enabled ) ;
+    bool					IsTurboEnabled				( ) const {
+        return m_Turbo ;
+    }
+    double					GetSpeed					( ) const {
+        return m_Speed ;
+    }
+    void					FramePublished				( ) ;
   private:
+    // what the main thread asks the emulation thread to do
+    enum {
+        COMMAND_KEY_DOWN,
+        COMMAND_KEY_UP,
+        COMMAND_TURBO,
+        COMMAND_AUDIO_SYNC,
+        COMMAND_RUN_AHEAD,
+        COMMAND_REFRESH_RATE
+    };
+
+    struct EmulationCommand {
+        int		type ;
+        int		value ;			// the key, or the new setting
+        Uint32	timestamp ;		// when a key went down or up
+    };
+
     GameBoy						(void);
 
     bool					CreateSDLWindow				( ) ;
+    void					DrawFrameLines				( SDL_Texture* texture, const Frame& frame, int firstLine, int lastLine ) ;
+    void					DrawFilteredFrame			( SDL_Texture* texture, const Frame& frame ) ;
+    void					ApplyVideoSettings			( ) ;
+    void					SetPaused					( bool paused ) ;
+    void					UpdateTurbo					( ) ;
+    void					UpdateWindowTitle			( ) ;
+    void					SetVsync					( bool enabled ) ;
+    void					SetAudioSync				( bool enabled ) ;
+    void					SetRunAhead					( int frames ) ;
+    void					ToggleRecording				( ) ;
+    void					SaveScreenshot				( ) ;
+    void					OpenAudio					( ) ;
+    void					QueueAudio					( ) ;
+    void					QueueKey					( int key, bool pressed, Uint32 timestamp ) ;
+    void					StartEmulationThread		( ) ;
+    bool					StopEmulationThread			( ) ;
+    void					EmulationThreadMain			( ) ;
+    void					SendCommand					( int type, int value, Uint32 timestamp ) ;
+    void					ApplyCommand				( const EmulationCommand& command ) ;
 
 
     static				GameBoy*				m_Instance ;
@@ -36,6 +88,37 @@ class GameBoy {
     SDL_Renderer*           m_renderer;
     SDL_Texture*            m_texture;
     HWND                    hWnd;
+    HMENU					m_FileMenu ;
+    HMENU					m_VideoMenu ;
+    ScreenFilter			m_Filter ;
+    std::vector<unsigned char>	m_FilterInput ;	// the whole frame in colour, what the filter works from
+    VideoRecorder			m_Recorder ;
+    ScreenshotWriter		m_Screenshots ;
+    FramePacer				m_Pacer ;
+    SDL_AudioDeviceID		m_AudioDevice ;		// 0 if there is no sound
+    std::vector<short>		m_AudioSamples ;	// interleaved stereo on its way from the emulator to SDL
+    Uint32					m_FrameEvent ;		// SDL user events from the emulation thread
+    Uint32					m_SpeedEvent ;
+
+    // only touched by the main thread
+    bool					m_RomLoaded ;
+    bool					m_Paused ;
+    bool					m_Turbo ;
+    bool					m_Vsync ;
+    bool					m_AudioSync ;
+    double					m_Speed ;			// the last turbo speed the emulation thread sent
+    bool					m_FilterSettled ;	// false while the ghosting is still fading in the frame on screen
+
+    std::thread*			m_EmulationThread ;	// NULL while there is nothing to run, or paused
+    std::atomic<bool>		m_StopEmulation ;
+    std::atomic<bool>		m_FrameEventPending ;	// a frame event is waiting for the main thread
+    RingBuffer<EmulationCommand, 256>	m_Commands ;
+
+    // only touched by whichever thread owns the emulator, the emulation thread while it runs
+    int						m_TurboFramePeriod ;	// frame skip turbo has set, 1 in this many frames is drawn
+    int						m_RunAhead ;			// frames, put back on when turbo finishes
+    Uint32					m_InputTicks ;			// SDL_GetTicks when the last update started
+    unsigned long long		m_InputCycles ;			// the emulator's total cycles when it finished
 };
 
 #endif
@@ -0,0 +1,286 @@
+#include "Config.h"
+#include "Emulator.h"
+#include "FramePacer.h"
+#include "ScreenshotWriter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// command line runner for the emulator core, no window, no SDL and no Win32. Runs a ROM for a fixed number
+// of frames or cycles as fast as it can, then prints how fast that was and hashes of the final state so
+// runs can be compared
+
+#define DEFAULT_FRAMES 3600
+#define WAV_SAMPLE_RATE 48000
+
+struct InputEvent {
+    unsigned long long frame ;
+    int cycle ;				// from the start of the frame
+    int key ;
+    bool pressed ;
+};
+
+// same numbering as Emulator::KeyPressed
+static const char* keyNames[8] = { "right", "left", "up", "down", "a", "b", "select", "start" } ;
+
+//////////////////////////////////////////////////////////////////
+
+static void PrintUsage( ) {
+    fprintf(stderr,
+            "usage: ironboy-headless <rom> [options]\n"
+            "  --frames N          run N frames (default %d)\n"
+            "  --cycles N          run until at least N cycles, whole frames at a time\n"
+            "  --input FILE        scripted input, lines of \"<frame>[+<cycle>] <button> down|up\"\n"
+            "                      buttons are right left up down a b select start\n"
+            "  --frame-skip N      only draw 1 frame in every N\n"
+            "  --no-render         don't draw at all, the frame hash is then meaningless\n"
+            "  --render-thread     draw the scanlines on a second thread\n"
+            "  --run-ahead N       draw each frame from N (1 - 3) frames ahead, see Emulator::UpdateRunAhead\n"
+            "  --screenshot FILE   save the last frame as a PNG\n"
+            "  --wav FILE          save the sound as a 16 bit stereo WAV\n",
+            DEFAULT_FRAMES) ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+static bool LoadInputScript(const char* fileName, std::vector<InputEvent>& events) {
+    FILE* file = fopen(fileName, "r") ;
+    if (file == NULL) {
+        fprintf(stderr, "cannot open input script %s\n", fileName) ;
+        return false ;
+    }
+
+    char line[256] ;
+    int lineNumber = 0 ;
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++ ;
+
+        char* comment = strchr(line, '#') ;
+        if (comment) {
+            *comment = '\0' ;
+        }
+
+        char when[32] ;
+        char button[32] ;
+        char state[32] ;
+        int fields = sscanf(line, "%31s %31s %31s", when, button, state) ;
+        if (fields <= 0) {
+            continue ;
+        }
+
+        // the cycle puts the change at an exact point in the frame, without one it is the start
+        char* end ;
+        InputEvent event ;
+        event.frame = strtoull(when, &end, 10) ;
+        event.cycle = 0 ;
+        if (*end == '+') {
+            event.cycle = (int) strtol(end + 1, &end, 10) ;
+        }
+        event.key = -1 ;
+        for (int key = 0; key < 8; key++) {
+            if (strcmp(button, keyNames[key]) == 0) {
+                event.key = key ;
+            }
+        }
+        event.pressed = fields == 3 && strcmp(state, "down") == 0 ;
+
+        if (fields != 3 || *end != '\0' || !isdigit((unsigned char) when[0]) || event.cycle < 0 || event.key == -1 ||
+                (!event.pressed && strcmp(state, "up") != 0)) {
+            fprintf(stderr, "%s:%d: expected \"<frame>[+<cycle>] <button> down|up\"\n", fileName, lineNumber) ;
+            fclose(file) ;
+            return false ;
+        }
+
+        events.push_back(event) ;
+    }
+
+    fclose(file) ;
+
+    // presses at the same point keep the order they were written in
+    std::stable_sort(events.begin(), events.end(), [](const InputEvent& a, const InputEvent& b) {
+        return a.frame < b.frame || (a.frame == b.frame && a.cycle < b.cycle) ;
+    }) ;
+    return true ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+static void WriteLittleEndian(FILE* file, unsigned int value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc((value >> (i * 8)) & 0xFF, file) ;
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// samples are interleaved left and right
+static bool WriteWav(const char* fileName, const std::vector<short>& samples) {
+    FILE* file = fopen(fileName, "wb") ;
+    if (file == NULL) {
+        fprintf(stderr, "cannot create %s\n", fileName) ;
+        return false ;
+    }
+
+    unsigned int dataSize = (unsigned int) (samples.size() * sizeof(short)) ;
+
+    fwrite("RIFF", 1, 4, file) ;
+    WriteLittleEndian(file, 36 + dataSize, 4) ;
+    fwrite("WAVEfmt ", 1, 8, file) ;
+    WriteLittleEndian(file, 16, 4) ;						// format chunk size
+    WriteLittleEndian(file, 1, 2) ;							// PCM
+    WriteLittleEndian(file, 2, 2) ;							// channels
+    WriteLittleEndian(file, WAV_SAMPLE_RATE, 4) ;
+    WriteLittleEndian(file, WAV_SAMPLE_RATE * 4, 4) ;		// bytes per second
+    WriteLittleEndian(file, 4, 2) ;							// bytes per sample
+    WriteLittleEndian(file, 16, 2) ;						// bits per channel
+    fwrite("data", 1, 4, file) ;
+    WriteLittleEndian(file, dataSize, 4) ;
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        WriteLittleEndian(file, (unsigned short) samples[i], 2) ;
+    }
+
+    bool ok = ferror(file) == 0 ;
+    fclose(file) ;
+    if (!ok) {
+        fprintf(stderr, "cannot write %s\n", fileName) ;
+    }
+    return ok ;
+}
+
+//////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        PrintUsage() ;
+        return 1 ;
+    }
+
+    const char* romName = argv[1] ;
+    unsigned long long maxFrames = DEFAULT_FRAMES ;
+    unsigned long long maxCycles = 0 ;
+    int frameSkip = 1 ;
+    bool noRender = false ;
+    bool renderThread = false ;
+    int runAhead = 0 ;
+    const char* screenshotName = NULL ;
+    const char* wavName = NULL ;
+    std::vector<InputEvent> events ;
+    std::vector<short> samples ;
+
+    for (int i = 2; i < argc; i++) {
+        bool hasValue = i + 1 < argc ;
+
+        if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+            maxFrames = strtoull(argv[++i], NULL, 10) ;
+            maxCycles = 0 ;
+        } else if (strcmp(argv[i], "--cycles") == 0 && hasValue) {
+            maxCycles = strtoull(argv[++i], NULL, 10) ;
+            maxFrames = 0 ;
+        } else if (strcmp(argv[i], "--input") == 0 && hasValue) {
+            if (!LoadInputScript(argv[++i], events)) {
+                return 1 ;
+            }
+        } else if (strcmp(argv[i], "--frame-skip") == 0 && hasValue) {
+            frameSkip = atoi(argv[++i]) ;
+        } else if (strcmp(argv[i], "--no-render") == 0) {
+            noRender = true ;
+        } else if (strcmp(argv[i], "--render-thread") == 0) {
+            renderThread = true ;
+        } else if (strcmp(argv[i], "--run-ahead") == 0 && hasValue) {
+            runAhead = atoi(argv[++i]) ;
+        } else if (strcmp(argv[i], "--screenshot") == 0 && hasValue) {
+            screenshotName = argv[++i] ;
+        } else if (strcmp(argv[i], "--wav") == 0 && hasValue) {
+            wavName = argv[++i] ;
+        } else {
+            PrintUsage() ;
+            return 1 ;
+        }
+    }
+
+    if (frameSkip < 1 || runAhead < 0 || runAhead > 3 || (maxFrames == 0 && maxCycles == 0)) {
+        PrintUsage() ;
+        return 1 ;
+    }
+
+    LogMessage* log = LogMessage::CreateInstance() ;
+    Emulator* emulator = new Emulator(false) ;
+
+    if (!emulator->LoadRom(romName)) {
+        fprintf(stderr, "cannot load %s\n", romName) ;
+        delete emulator ;
+        delete log ;
+        return 1 ;
+    }
+
+    emulator->SetFrameSkip(1, frameSkip) ;
+    emulator->SetHeadless(noRender) ;
+    emulator->SetRenderThread(renderThread) ;
+    emulator->SetRunAhead(runAhead) ;
+    emulator->SetAudioSampleRate(wavName ? WAV_SAMPLE_RATE : 0) ;
+
+    unsigned long long frames = 0 ;
+    unsigned long long framesDrawn = 0 ;
+    unsigned long long cycles = 0 ;
+    size_t nextEvent = 0 ;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now() ;
+
+    while ((maxFrames == 0 || frames < maxFrames) && (maxCycles == 0 || cycles < maxCycles)) {
+        // the emulator makes each change at its exact cycle, so a replay always plays out the same way
+        for (; nextEvent < events.size() && events[nextEvent].frame <= frames; nextEvent++) {
+            emulator->QueueInput(events[nextEvent].key, events[nextEvent].pressed,
+                                 emulator->GetTotalCycles() + events[nextEvent].cycle) ;
+        }
+
+        if (emulator->Update()) {
+            framesDrawn++ ;
+        }
+        cycles += emulator->GetCyclesThisUpdate() ;
+        frames++ ;
+
+        if (wavName) {
+            size_t size = samples.size() ;
+            samples.resize(size + emulator->GetAudioSamplesAvailable() * 2) ;
+            samples.resize(size + emulator->ReadAudioSamples(&samples[size], emulator->GetAudioSamplesAvailable()) * 2) ;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() ;
+    double framesPerSecond = seconds > 0 ? frames / seconds : 0 ;
+
+    printf("frames       %llu\n", frames) ;
+    printf("drawn        %llu\n", framesDrawn) ;
+    printf("cycles       %llu\n", cycles) ;
+    printf("time         %.3f s\n", seconds) ;
+    printf("speed        %.1f frames/s, %.2fx real time\n", framesPerSecond,
+           seconds > 0 ? cycles / seconds / GAMEBOY_CLOCK_HZ : 0) ;
+    printf("emulated     %.2f MHz\n", seconds > 0 ? cycles / seconds / 1e6 : 0) ;
+    printf("frame hash   %016llx\n", emulator->GetFrameHash()) ;
+    printf("state hash   %016llx\n", emulator->GetStateHash()) ;
+
+    if (screenshotName) {
+        // the writer finishes the file before it is destroyed
+        ScreenshotWriter screenshots ;
+        FrameBuffer* frameBuffer = emulator->GetFrameBuffer() ;
+        frameBuffer->AcquireFrame() ;
+        screenshots.Capture(frameBuffer->GetFrontFrame(), screenshotName) ;
+    }
+
+    bool ok = wavName == NULL || WriteWav(wavName, samples) ;
+
+    // long enough for frame skipping and running ahead to have come round to a frame that is drawn, so the
+    // frame hash would be of nothing. Only a game that keeps the screen off all that time gets here legitimately
+    if (!noRender && framesDrawn == 0 && frames > (unsigned long long) (frameSkip + runAhead)) {
+        fprintf(stderr, "no frames were drawn\n") ;
+        ok = false ;
+    }
+
+    delete emulator ;
+    delete log ;
+    return ok ? 0 : 1 ;
+}
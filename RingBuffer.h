@@ -0,0 +1,57 @@
+#pragma once
+#ifndef _RINGBUFFER_H
+#define _RINGBUFFER_H
+
+#include <atomic>
+
+// fixed size lock-free queue for exactly one producer thread and one consumer thread. Push and Pop never
+// block, they return false when the queue is full or empty and the caller decides whether to wait.
+// Size must be a power of two
+template <typename T, unsigned int Size>
+class RingBuffer {
+    static_assert(Size > 0 && (Size & (Size - 1)) == 0, "RingBuffer size must be a power of two") ;
+
+  public:
+    RingBuffer					(void) :
+        m_Head(0)
+        ,m_Tail(0) {
+    }
+
+    // producer side
+    bool				Push				( const T& item ) {
+        unsigned int head = m_Head.load(std::memory_order_relaxed) ;
+        if (head - m_Tail.load(std::memory_order_acquire) == Size) {
+            return false ;
+        }
+
+        m_Items[head & (Size - 1)] = item ;
+        m_Head.store(head + 1, std::memory_order_release) ;
+        return true ;
+    }
+
+    // consumer side
+    bool				Pop					( T& item ) {
+        unsigned int tail = m_Tail.load(std::memory_order_relaxed) ;
+        if (tail == m_Head.load(std::memory_order_acquire)) {
+            return false ;
+        }
+
+        item = m_Items[tail & (Size - 1)] ;
+        m_Tail.store(tail + 1, std::memory_order_release) ;
+        return true ;
+    }
+
+    // either side, the answer may already be out of date when it returns
+    unsigned int		GetCount			( ) const {
+        return m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire) ;
+    }
+
+  private:
+    T							m_Items[Size] ;
+
+    // a cache line each, so the two threads aren't fighting over one line every time either side moves on
+    alignas(64) std::atomic<unsigned int>	m_Head ;	// next slot the producer writes, only the producer stores it
+    alignas(64) std::atomic<unsigned int>	m_Tail ;	// next slot the consumer reads, only the consumer stores it
+};
+
+#endif
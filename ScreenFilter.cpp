@@ -0,0 +1,715 @@
+#include "Config.h"
+#include "ScreenFilter.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FILTER_USE_SSE2
+#endif
+
+// never worth more than this many threads for a frame this small
+#define MAX_FILTER_BANDS 4
+
+// the grid darkens the edge of every pixel by a quarter, alpha is left alone
+#define GRID_MASK 0x003F3F3F
+
+// xBR treats two colours as the same when they are closer than this, see XbrDiff
+#define XBR_EQUAL_THRESHOLD 155
+
+//////////////////////////////////////////////////////////////////
+
+ScreenFilter::ScreenFilter(void) :
+    m_Filter(FILTER_NONE)
+    ,m_Scale(2)
+    ,m_Grid(false)
+    ,m_Ghosting(false)
+    ,m_HistoryValid(false)
+    ,m_Generation(0)
+    ,m_BandsLeft(0)
+    ,m_NumBands(1)
+    ,m_Quit(false) {
+    int cores = std::thread::hardware_concurrency();
+
+    m_NumBands = cores < 1 ? 1 : (cores > MAX_FILTER_BANDS ? MAX_FILTER_BANDS : cores);
+    m_BandSettled.assign(m_NumBands, 1);
+
+    for (int band = 1; band < m_NumBands; band++) {
+        m_Workers.push_back(new std::thread(&ScreenFilter::WorkerMain, this, band));
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+ScreenFilter::~ScreenFilter(void) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_WorkReady.notify_all();
+
+    for (std::vector<std::thread*>::iterator it = m_Workers.begin(); it != m_Workers.end(); it++) {
+        (*it)->join();
+        delete (*it);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenFilter::SetFilter(SCREEN_FILTER filter) {
+    m_Filter = filter;
+    m_HistoryValid = false;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenFilter::SetScale(int scale) {
+    assert(scale >= 1 && scale <= 4);
+
+    m_Scale = scale;
+    m_HistoryValid = false;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenFilter::SetGrid(bool enabled) {
+    m_Grid = enabled;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenFilter::SetGhosting(bool enabled) {
+    m_Ghosting = enabled;
+    m_HistoryValid = false;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// Y, U + 128 and V + 128 in the bottom three bytes, what xBR compares colours by
+static unsigned int ToYuv(unsigned int colour) {
+    int b = colour & 0xFF;
+    int g = (colour >> 8) & 0xFF;
+    int r = (colour >> 16) & 0xFF;
+
+    int y = (299 * r + 587 * g + 114 * b) / 1000;
+    int u = (-169 * r - 331 * g + 500 * b) / 1000 + 128;
+    int v = (500 * r - 419 * g - 81 * b) / 1000 + 128;
+
+    return y | (u << 8) | (v << 16);
+}
+
+//////////////////////////////////////////////////////////////////
+
+// Scale4x is Scale2x run twice, the first pass goes into m_Intermediate
+bool ScreenFilter::Apply(const unsigned char* source, unsigned char* dest, int pitch) {
+    int width = FRAME_WIDTH * m_Scale;
+    int height = FRAME_HEIGHT * m_Scale;
+
+    if (m_Ghosting && m_History.size() != (size_t) (width * height)) {
+        m_History.assign(width * height, 0);
+        m_HistoryValid = false;
+    }
+
+    Pass pass;
+    pass.source = (const unsigned int*) source;
+    pass.yuv = NULL;
+    pass.width = FRAME_WIDTH;
+    pass.height = FRAME_HEIGHT;
+    pass.dest = dest;
+    pass.pitch = pitch;
+    pass.factor = m_Scale;
+    pass.method = METHOD_REPEAT;
+    pass.last = true;
+
+    if (m_Filter == FILTER_SCALENX) {
+        switch (m_Scale) {
+        case 2:
+            pass.method = METHOD_SCALE2X;
+            break;
+        case 3:
+            pass.method = METHOD_SCALE3X;
+            break;
+        case 4: {
+            m_Intermediate.resize(FRAME_WIDTH * 2 * FRAME_HEIGHT * 2);
+
+            Pass first = pass;
+            first.dest = (unsigned char*) &m_Intermediate[0];
+            first.pitch = FRAME_WIDTH * 2 * 4;
+            first.factor = 2;
+            first.method = METHOD_SCALE2X;
+            first.last = false;
+            RunPass(first);
+
+            pass.source = &m_Intermediate[0];
+            pass.width = FRAME_WIDTH * 2;
+            pass.height = FRAME_HEIGHT * 2;
+            pass.factor = 2;
+            pass.method = METHOD_SCALE2X;
+            break;
+        }
+        }
+    } else if (m_Filter == FILTER_XBR && m_Scale > 1) {
+        // every band looks two rows into its neighbours, so the whole frame is converted first
+        m_Yuv.resize(FRAME_WIDTH * FRAME_HEIGHT);
+        for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++) {
+            m_Yuv[i] = ToYuv(pass.source[i]);
+        }
+
+        pass.yuv = &m_Yuv[0];
+        pass.method = METHOD_XBR;
+    }
+
+    RunPass(pass);
+
+    if (!m_Ghosting) {
+        return true;
+    }
+
+    m_HistoryValid = true;
+    for (int band = 0; band < m_NumBands; band++) {
+        if (!m_BandSettled[band]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenFilter::RunPass(const Pass& pass) {
+    if (m_NumBands == 1) {
+        m_Pass = pass;
+        FilterBand(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Pass = pass;
+        m_BandsLeft = m_NumBands - 1;
+        m_Generation++;
+    }
+    m_WorkReady.notify_all();
+
+    FilterBand(0);
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (m_BandsLeft > 0) {
+        m_WorkDone.wait(lock);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenFilter::WorkerMain(int band) {
+    unsigned int generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            while (!m_Quit && m_Generation == generation) {
+                m_WorkReady.wait(lock);
+            }
+
+            if (m_Quit) {
+                return;
+            }
+            generation = m_Generation;
+        }
+
+        FilterBand(band);
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (--m_BandsLeft == 0) {
+            m_WorkDone.notify_one();
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+static void RepeatRow(const unsigned int* row, int width, int factor, unsigned int* out) {
+    for (int x = 0; x < width; x++) {
+        for (int i = 0; i < factor; i++) {
+            out[x * factor + i] = row[x];
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// Scale2x (AdvanceMAME). Each pixel E becomes 4, a corner takes the colour of its two neighbours if they
+// match and the pixel is not on a straight edge
+//   B        E0 E1
+// D E F      E2 E3
+//   H
+static void Scale2xRow(const unsigned int* above, const unsigned int* row, const unsigned int* below, int width,
+                       unsigned int* out0, unsigned int* out1) {
+#ifdef FILTER_USE_SSE2
+    // width is always a multiple of 4, the neighbours past either end of the row are the end pixel itself
+    assert((width & 3) == 0);
+
+    const __m128i ones = _mm_set1_epi32(-1);
+
+    for (int x = 0; x < width; x += 4) {
+        __m128i B = _mm_loadu_si128((const __m128i*) (above + x));
+        __m128i E = _mm_loadu_si128((const __m128i*) (row + x));
+        __m128i H = _mm_loadu_si128((const __m128i*) (below + x));
+        __m128i D = x > 0 ? _mm_loadu_si128((const __m128i*) (row + x - 1))
+                    : _mm_set_epi32(row[2], row[1], row[0], row[0]);
+        __m128i F = x + 4 < width ? _mm_loadu_si128((const __m128i*) (row + x + 1))
+                    : _mm_set_epi32(row[width - 1], row[width - 1], row[width - 2], row[width - 3]);
+
+        // only corners of pixels that are not on a straight line are changed
+        __m128i corner = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(B, H), _mm_cmpeq_epi32(D, F)), ones);
+
+        __m128i m0 = _mm_and_si128(corner, _mm_cmpeq_epi32(D, B));
+        __m128i m1 = _mm_and_si128(corner, _mm_cmpeq_epi32(B, F));
+        __m128i m2 = _mm_and_si128(corner, _mm_cmpeq_epi32(D, H));
+        __m128i m3 = _mm_and_si128(corner, _mm_cmpeq_epi32(H, F));
+
+        __m128i E0 = _mm_or_si128(_mm_and_si128(m0, D), _mm_andnot_si128(m0, E));
+        __m128i E1 = _mm_or_si128(_mm_and_si128(m1, F), _mm_andnot_si128(m1, E));
+        __m128i E2 = _mm_or_si128(_mm_and_si128(m2, D), _mm_andnot_si128(m2, E));
+        __m128i E3 = _mm_or_si128(_mm_and_si128(m3, F), _mm_andnot_si128(m3, E));
+
+        _mm_storeu_si128((__m128i*) (out0 + x * 2), _mm_unpacklo_epi32(E0, E1));
+        _mm_storeu_si128((__m128i*) (out0 + x * 2 + 4), _mm_unpackhi_epi32(E0, E1));
+        _mm_storeu_si128((__m128i*) (out1 + x * 2), _mm_unpacklo_epi32(E2, E3));
+        _mm_storeu_si128((__m128i*) (out1 + x * 2 + 4), _mm_unpackhi_epi32(E2, E3));
+    }
+#else
+    for (int x = 0; x < width; x++) {
+        unsigned int B = above[x];
+        unsigned int D = row[x > 0 ? x - 1 : x];
+        unsigned int E = row[x];
+        unsigned int F = row[x < width - 1 ? x + 1 : x];
+        unsigned int H = below[x];
+
+        if (B != H && D != F) {
+            out0[x * 2] = D == B ? D : E;
+            out0[x * 2 + 1] = B == F ? F : E;
+            out1[x * 2] = D == H ? D : E;
+            out1[x * 2 + 1] = H == F ? F : E;
+        } else {
+            out0[x * 2] = out0[x * 2 + 1] = E;
+            out1[x * 2] = out1[x * 2 + 1] = E;
+        }
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////
+
+// Scale3x (AdvanceMAME). Same idea as Scale2x with the 8 surrounding pixels
+// A B C      E0 E1 E2
+// D E F      E3 E4 E5
+// G H I      E6 E7 E8
+static void Scale3xRow(const unsigned int* above, const unsigned int* row, const unsigned int* below, int width,
+                       unsigned int* out0, unsigned int* out1, unsigned int* out2) {
+    for (int x = 0; x < width; x++) {
+        int left = x > 0 ? x - 1 : x;
+        int right = x < width - 1 ? x + 1 : x;
+
+        unsigned int A = above[left], B = above[x], C = above[right];
+        unsigned int D = row[left], E = row[x], F = row[right];
+        unsigned int G = below[left], H = below[x], I = below[right];
+
+        unsigned int* o0 = out0 + x * 3;
+        unsigned int* o1 = out1 + x * 3;
+        unsigned int* o2 = out2 + x * 3;
+
+        if (B != H && D != F) {
+            o0[0] = D == B ? D : E;
+            o0[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+            o0[2] = B == F ? F : E;
+            o1[0] = (D == B && E != G) || (D == H && E != A) ? D : E;
+            o1[1] = E;
+            o1[2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+            o2[0] = D == H ? D : E;
+            o2[1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+            o2[2] = H == F ? F : E;
+        } else {
+            o0[0] = o0[1] = o0[2] = E;
+            o1[0] = o1[1] = o1[2] = E;
+            o2[0] = o2[1] = o2[2] = E;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// how different two colours look, brightness counts for far more than the colour
+static inline int XbrDiff(unsigned int a, unsigned int b) {
+    int y = (int) (a & 0xFF) - (int) (b & 0xFF);
+    int u = (int) ((a >> 8) & 0xFF) - (int) ((b >> 8) & 0xFF);
+    int v = (int) ((a >> 16) & 0xFF) - (int) ((b >> 16) & 0xFF);
+
+    return 48 * (y < 0 ? -y : y) + 7 * (u < 0 ? -u : u) + 6 * (v < 0 ? -v : v);
+}
+
+// moves each channel of dest towards src by m / 2^s
+static inline void XbrBlend(unsigned int& dest, unsigned int src, int m, int s) {
+    unsigned int result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int d = (dest >> shift) & 0xFF;
+        int c = (src >> shift) & 0xFF;
+        result |= (unsigned int) (d + (((c - d) * m) >> s)) << shift;
+    }
+    dest = result;
+}
+
+// the pixels around E that xBR looks at, with their offsets from it
+//       A1 B1 C1
+//    A0 A  B  C  C4
+//    D0 D  E  F  F4
+//    G0 G  H  I  I4
+//       G5 H5 I5
+struct XbrWindow {
+    unsigned int		colour[5][5] ;
+    unsigned int		yuv[5][5] ;
+};
+
+// one corner of the output block for E. The code is written for the bottom right corner, rotation turns
+// everything it looks at and writes a quarter turn anticlockwise that many times to reach the others.
+// factor is the size of the block
+class XbrCorner {
+  public:
+    XbrCorner(const XbrWindow& window, unsigned int* block, int factor, int rotation) :
+        m_Window(window)
+        ,m_Block(block)
+        ,m_Factor(factor)
+        ,m_Rotation(rotation) {
+    }
+
+    void Filter( ) {
+        unsigned int E = Colour(0, 0), F = Colour(0, 1), H = Colour(1, 0);
+        if (E == H || E == F) {
+            return;
+        }
+
+        // how much the colours change across each diagonal, the edge runs along the one that changes least
+        int e = Diff(0, 0, -1, 1) + Diff(0, 0, 1, -1) + Diff(1, 1, 2, 0) + Diff(1, 1, 0, 2) + 4 * Diff(1, 0, 0, 1);
+        int i = Diff(1, 0, 0, -1) + Diff(1, 0, 2, 1) + Diff(0, 1, 1, 2) + Diff(0, 1, -1, 0) + 4 * Diff(0, 0, 1, 1);
+        unsigned int pixel = Diff(0, 0, 0, 1) <= Diff(0, 0, 1, 0) ? F : H;
+
+        if (e < i && ((!Equal(0, 1, -1, 0) && !Equal(1, 0, 0, -1)) ||
+                      (Equal(0, 0, 1, 1) && !Equal(0, 1, 1, 2) && !Equal(1, 0, 2, 1)) ||
+                      Equal(0, 0, 1, -1) || Equal(0, 0, -1, 1))) {
+            // a shallow edge reaches further along the bottom, a steep one further up the side
+            int ke = Diff(0, 1, 1, -1);
+            int ki = Diff(1, 0, -1, 1);
+            unsigned int C = Colour(-1, 1), G = Colour(1, -1);
+            bool shallow = ke * 2 <= ki && E != G && Colour(0, -1) != G;
+            bool steep = ke >= ki * 2 && E != C && Colour(-1, 0) != C;
+
+            switch (m_Factor) {
+            case 2:
+                Edge2x(pixel, shallow, steep);
+                break;
+            case 3:
+                Edge3x(pixel, shallow, steep);
+                break;
+            default:
+                Edge4x(pixel, shallow, steep);
+                break;
+            }
+        } else if (e <= i) {
+            XbrBlend(Out(m_Factor - 1, m_Factor - 1), pixel, 1, 1);
+        }
+    }
+
+  private:
+    // turns an offset from E into the window's coordinates
+    void Rotate(int& dy, int& dx) const {
+        for (int turn = 0; turn < m_Rotation; turn++) {
+            int y = dy;
+            dy = -dx;
+            dx = y;
+        }
+    }
+
+    unsigned int Colour(int dy, int dx) const {
+        Rotate(dy, dx);
+        return m_Window.colour[dy + 2][dx + 2];
+    }
+
+    int Diff(int dy1, int dx1, int dy2, int dx2) const {
+        Rotate(dy1, dx1);
+        Rotate(dy2, dx2);
+        return XbrDiff(m_Window.yuv[dy1 + 2][dx1 + 2], m_Window.yuv[dy2 + 2][dx2 + 2]);
+    }
+
+    bool Equal(int dy1, int dx1, int dy2, int dx2) const {
+        return Diff(dy1, dx1, dy2, dx2) < XBR_EQUAL_THRESHOLD;
+    }
+
+    // row and column of the block as if this was the bottom right corner
+    unsigned int& Out(int row, int column) {
+        for (int turn = 0; turn < m_Rotation; turn++) {
+            int r = row;
+            row = m_Factor - 1 - column;
+            column = r;
+        }
+        return m_Block[row * m_Factor + column];
+    }
+
+    void Edge2x(unsigned int pixel, bool shallow, bool steep) {
+        if (shallow && steep) {
+            XbrBlend(Out(1, 1), pixel, 7, 3);
+            XbrBlend(Out(1, 0), pixel, 1, 2);
+            Out(0, 1) = Out(1, 0);
+        } else if (shallow) {
+            XbrBlend(Out(1, 1), pixel, 3, 2);
+            XbrBlend(Out(1, 0), pixel, 1, 2);
+        } else if (steep) {
+            XbrBlend(Out(1, 1), pixel, 3, 2);
+            XbrBlend(Out(0, 1), pixel, 1, 2);
+        } else {
+            XbrBlend(Out(1, 1), pixel, 1, 1);
+        }
+    }
+
+    void Edge3x(unsigned int pixel, bool shallow, bool steep) {
+        if (shallow && steep) {
+            XbrBlend(Out(2, 1), pixel, 3, 2);
+            XbrBlend(Out(2, 0), pixel, 1, 2);
+            Out(1, 2) = Out(2, 1);
+            Out(0, 2) = Out(2, 0);
+            Out(2, 2) = pixel;
+        } else if (shallow) {
+            XbrBlend(Out(2, 1), pixel, 3, 2);
+            XbrBlend(Out(1, 2), pixel, 1, 2);
+            XbrBlend(Out(2, 0), pixel, 1, 2);
+            Out(2, 2) = pixel;
+        } else if (steep) {
+            XbrBlend(Out(1, 2), pixel, 3, 2);
+            XbrBlend(Out(2, 1), pixel, 1, 2);
+            XbrBlend(Out(0, 2), pixel, 1, 2);
+            Out(2, 2) = pixel;
+        } else {
+            XbrBlend(Out(2, 2), pixel, 1, 2);
+            XbrBlend(Out(1, 2), pixel, 1, 3);
+            XbrBlend(Out(2, 1), pixel, 1, 3);
+        }
+    }
+
+    void Edge4x(unsigned int pixel, bool shallow, bool steep) {
+        if (shallow && steep) {
+            XbrBlend(Out(3, 1), pixel, 3, 2);
+            XbrBlend(Out(3, 0), pixel, 1, 2);
+            Out(3, 3) = Out(3, 2) = Out(2, 3) = pixel;
+            Out(2, 2) = Out(0, 3) = Out(3, 0);
+            Out(1, 3) = Out(3, 1);
+        } else if (shallow) {
+            XbrBlend(Out(2, 3), pixel, 3, 2);
+            XbrBlend(Out(3, 1), pixel, 3, 2);
+            XbrBlend(Out(2, 2), pixel, 1, 2);
+            XbrBlend(Out(3, 0), pixel, 1, 2);
+            Out(3, 2) = Out(3, 3) = pixel;
+        } else if (steep) {
+            XbrBlend(Out(3, 2), pixel, 3, 2);
+            XbrBlend(Out(1, 3), pixel, 3, 2);
+            XbrBlend(Out(2, 2), pixel, 1, 2);
+            XbrBlend(Out(0, 3), pixel, 1, 2);
+            Out(2, 3) = Out(3, 3) = pixel;
+        } else {
+            XbrBlend(Out(2, 3), pixel, 1, 1);
+            XbrBlend(Out(3, 2), pixel, 1, 1);
+            Out(3, 3) = pixel;
+        }
+    }
+
+    const XbrWindow&	m_Window ;
+    unsigned int*		m_Block ;
+    int					m_Factor ;
+    int					m_Rotation ;
+};
+
+// xBR (Hyllian). Finds the edges running through each pixel's corners from the colours around it and
+// blends the output pixels either side of them, so diagonals and curves come out smooth rather than
+// stepped. Pixels in a flat area, most of a Game Boy screen, are just repeated
+static void XbrRow(const unsigned int* source, const unsigned int* yuv, int width, int height, int y, int factor,
+                   unsigned int** out) {
+    for (int x = 0; x < width; x++) {
+        XbrWindow window;
+        bool flat = true;
+        unsigned int E = source[y * width + x];
+
+        for (int dy = -2; dy <= 2; dy++) {
+            int row = y + dy < 0 ? 0 : (y + dy >= height ? height - 1 : y + dy);
+            for (int dx = -2; dx <= 2; dx++) {
+                int column = x + dx < 0 ? 0 : (x + dx >= width ? width - 1 : x + dx);
+                window.colour[dy + 2][dx + 2] = source[row * width + column];
+                window.yuv[dy + 2][dx + 2] = yuv[row * width + column];
+            }
+        }
+
+        for (int dy = 1; dy <= 3 && flat; dy++) {
+            for (int dx = 1; dx <= 3; dx++) {
+                if (window.colour[dy][dx] != E) {
+                    flat = false;
+                    break;
+                }
+            }
+        }
+
+        unsigned int block[16];
+        for (int i = 0; i < factor * factor; i++) {
+            block[i] = E;
+        }
+
+        if (!flat) {
+            for (int rotation = 0; rotation < 4; rotation++) {
+                XbrCorner(window, block, factor, rotation).Filter();
+            }
+        }
+
+        for (int row = 0; row < factor; row++) {
+            memcpy(out[row] + x * factor, block + row * factor, factor * 4);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// bands split the source rows evenly. Every band reads one row either side of its own (two for xBR) but
+// only writes its own output rows so they never overlap
+void ScreenFilter::FilterBand(int band) {
+    const Pass& pass = m_Pass;
+    int firstRow = pass.height * band / m_NumBands;
+    int lastRow = pass.height * (band + 1) / m_NumBands;
+
+    for (int y = firstRow; y < lastRow; y++) {
+        const unsigned int* row = pass.source + y * pass.width;
+        const unsigned int* above = y > 0 ? row - pass.width : row;
+        const unsigned int* below = y < pass.height - 1 ? row + pass.width : row;
+
+        unsigned int* out[4];
+        for (int i = 0; i < pass.factor; i++) {
+            out[i] = (unsigned int*) (pass.dest + (y * pass.factor + i) * pass.pitch);
+        }
+
+        switch (pass.method) {
+        case METHOD_SCALE2X:
+            Scale2xRow(above, row, below, pass.width, out[0], out[1]);
+            break;
+        case METHOD_SCALE3X:
+            Scale3xRow(above, row, below, pass.width, out[0], out[1], out[2]);
+            break;
+        case METHOD_XBR:
+            XbrRow(pass.source, pass.yuv, pass.width, pass.height, y, pass.factor, out);
+            break;
+        default:
+            RepeatRow(row, pass.width, pass.factor, out[0]);
+            for (int i = 1; i < pass.factor; i++) {
+                memcpy(out[i], out[0], pass.width * pass.factor * 4);
+            }
+            break;
+        }
+    }
+
+    if (pass.last) {
+        if (m_Ghosting) {
+            m_BandSettled[band] = ApplyGhosting(pass.dest, pass.pitch, firstRow * pass.factor, lastRow * pass.factor);
+        }
+        if (m_Grid) {
+            ApplyGrid(pass.dest, pass.pitch, firstRow * pass.factor, lastRow * pass.factor);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the LCD is slow to change, every output pixel is averaged with what was shown last time. The average
+// rounds up, so a pixel fading darker would stop one short of the frame, once a pixel stops changing it
+// is given the frame's colour. Returns true if every pixel has caught up with the frame
+bool ScreenFilter::ApplyGhosting(unsigned char* dest, int pitch, int firstRow, int lastRow) {
+    int width = FRAME_WIDTH * m_Scale;
+    bool settled = true;
+
+    for (int y = firstRow; y < lastRow; y++) {
+        unsigned int* out = (unsigned int*) (dest + y * pitch);
+        unsigned int* history = &m_History[y * width];
+
+        if (!m_HistoryValid) {
+            memcpy(history, out, width * 4);
+            continue;
+        }
+
+#ifdef FILTER_USE_SSE2
+        __m128i behind = _mm_setzero_si128();
+
+        for (int x = 0; x < width; x += 4) {
+            __m128i current = _mm_loadu_si128((const __m128i*) (out + x));
+            __m128i previous = _mm_loadu_si128((const __m128i*) (history + x));
+            __m128i blended = _mm_avg_epu8(current, previous);
+
+            __m128i stopped = _mm_cmpeq_epi32(blended, previous);
+            blended = _mm_or_si128(_mm_and_si128(stopped, current), _mm_andnot_si128(stopped, blended));
+            behind = _mm_or_si128(behind, _mm_xor_si128(blended, current));
+
+            _mm_storeu_si128((__m128i*) (out + x), blended);
+            _mm_storeu_si128((__m128i*) (history + x), blended);
+        }
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(behind, _mm_setzero_si128())) != 0xFFFF) {
+            settled = false;
+        }
+#else
+        for (int x = 0; x < width; x++) {
+            // per byte average without carrying between the channels
+            unsigned int a = out[x];
+            unsigned int b = history[x];
+            unsigned int blended = (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+
+            if (blended == b) {
+                blended = a;
+            }
+            if (blended != a) {
+                settled = false;
+            }
+            out[x] = blended;
+            history[x] = blended;
+        }
+#endif
+    }
+
+    return settled;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// darkens the right and bottom edge of every Game Boy pixel so the output looks like the LCD matrix
+void ScreenFilter::ApplyGrid(unsigned char* dest, int pitch, int firstRow, int lastRow) {
+    if (m_Scale < 2) {
+        return;
+    }
+
+    int width = FRAME_WIDTH * m_Scale;
+
+    for (int y = firstRow; y < lastRow; y++) {
+        unsigned int* out = (unsigned int*) (dest + y * pitch);
+
+        // the bottom row of each pixel is darkened all the way across
+        if (y % m_Scale == m_Scale - 1) {
+#ifdef FILTER_USE_SSE2
+            const __m128i mask = _mm_set1_epi32(GRID_MASK);
+            for (int x = 0; x < width; x += 4) {
+                __m128i pixels = _mm_loadu_si128((const __m128i*) (out + x));
+                __m128i shade = _mm_and_si128(_mm_srli_epi32(pixels, 2), mask);
+                _mm_storeu_si128((__m128i*) (out + x), _mm_sub_epi8(pixels, shade));
+            }
+#else
+            for (int x = 0; x < width; x++) {
+                out[x] -= (out[x] >> 2) & GRID_MASK;
+            }
+#endif
+            continue;
+        }
+
+        for (int x = m_Scale - 1; x < width; x += m_Scale) {
+            out[x] -= (out[x] >> 2) & GRID_MASK;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+#ifndef _SCREENFILTER_H
+#define _SCREENFILTER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FrameBuffer.h"
+
+enum SCREEN_FILTER {
+    FILTER_NONE,		// plain pixel doubling
+    FILTER_SCALENX,		// Scale2x, Scale3x or Scale4x depending on the scale
+    FILTER_XBR			// 2xBR, 3xBR or 4xBR depending on the scale
+};
+
+// CPU side post processing of a finished frame. Scales the 160x144 BGRA frame by an integer factor with an
+// optional edge smoothing filter, then applies the LCD ghosting and grid effects. The work is split into
+// horizontal bands that are filtered in parallel
+class ScreenFilter {
+  public:
+    ScreenFilter				(void) ;
+    ~ScreenFilter				(void) ;
+
+    void				SetFilter			( SCREEN_FILTER filter ) ;
+    void				SetScale			( int scale ) ;
+    void				SetGrid				( bool enabled ) ;
+    void				SetGhosting			( bool enabled ) ;
+    SCREEN_FILTER		GetFilter			( ) const {
+        return m_Filter ;
+    }
+    int					GetScale			( ) const {
+        return m_Scale ;
+    }
+    bool				IsGridEnabled		( ) const {
+        return m_Grid ;
+    }
+    bool				IsGhostingEnabled	( ) const {
+        return m_Ghosting ;
+    }
+
+    // true if there is nothing to do on the CPU and the frame can just be stretched by the renderer
+    bool				IsPassThrough		( ) const {
+        return m_Filter == FILTER_NONE && !m_Grid && !m_Ghosting ;
+    }
+
+    // dest must hold FRAME_WIDTH * scale by FRAME_HEIGHT * scale pixels, pitch is in bytes. Returns false
+    // while the ghosting is still fading towards this frame, it then needs applying again (to the same frame
+    // if there is no new one) until it returns true
+    bool				Apply				( const unsigned char* source, unsigned char* dest, int pitch ) ;
+
+  private:
+    enum METHOD {
+        METHOD_REPEAT,
+        METHOD_SCALE2X,
+        METHOD_SCALE3X,
+        METHOD_XBR			// any factor from 2 to 4
+    };
+
+    // one scaling pass over the whole image, run a band at a time
+    struct Pass {
+        const unsigned int*	source ;
+        const unsigned int*	yuv ;		// the source in YUV, only for xBR
+        int					width ;
+        int					height ;
+        unsigned char*		dest ;
+        int					pitch ;
+        int					factor ;
+        METHOD				method ;
+        bool				last ;		// the ghosting and grid are applied to the output of the last pass
+    };
+
+    void				RunPass				( const Pass& pass ) ;
+    void				FilterBand			( int band ) ;
+    void				WorkerMain			( int band ) ;
+    bool				ApplyGhosting		( unsigned char* dest, int pitch, int firstRow, int lastRow ) ;
+    void				ApplyGrid			( unsigned char* dest, int pitch, int firstRow, int lastRow ) ;
+
+    SCREEN_FILTER		m_Filter ;
+    int					m_Scale ;
+    bool				m_Grid ;
+    bool				m_Ghosting ;
+
+    std::vector<unsigned int>	m_Intermediate ;	// output of the first Scale2x pass of Scale4x
+    std::vector<unsigned int>	m_Yuv ;				// the frame in YUV, what xBR compares colours by
+    std::vector<unsigned int>	m_History ;			// previous output for the ghosting, empty until there is one
+    bool				m_HistoryValid ;
+    std::vector<unsigned char>	m_BandSettled ;		// whether the ghosting of each band has caught up with the frame
+
+    // band workers, band 0 is always done by the calling thread
+    std::vector<std::thread*>	m_Workers ;
+    std::mutex			m_Mutex ;
+    std::condition_variable	m_WorkReady ;
+    std::condition_variable	m_WorkDone ;
+    Pass				m_Pass ;
+    unsigned int		m_Generation ;
+    int					m_BandsLeft ;
+    int					m_NumBands ;
+    bool				m_Quit ;
+};
+
+#endif
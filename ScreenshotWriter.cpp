@@ -0,0 +1,349 @@
+#include "Config.h"
+#include "ScreenshotWriter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// deflate match finder, a hash of the next 3 bytes leads to a chain of earlier positions with the same hash
+#define DEFLATE_HASH_SIZE 4096
+#define DEFLATE_MAX_CHAIN 64
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+static const unsigned char pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+// RFC 1951 length codes 257 - 285 and distance codes 0 - 29
+static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+                                    131, 163, 195, 227, 258
+                                  };
+static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+                                      2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+                                    };
+static const int distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+//////////////////////////////////////////////////////////////////
+
+// deflate bit stream, values go in least significant bit first and huffman codes most significant bit first
+class BitWriter {
+  public:
+    BitWriter					( std::vector<unsigned char>& out ) :
+        m_Out(out)
+        ,m_Bits(0)
+        ,m_Count(0) {
+    }
+
+    void				PutBits				( unsigned int value, int count ) {
+        m_Bits |= value << m_Count ;
+        m_Count += count ;
+        while (m_Count >= 8) {
+            m_Out.push_back(m_Bits & 0xFF) ;
+            m_Bits >>= 8 ;
+            m_Count -= 8 ;
+        }
+    }
+
+    void				PutCode				( unsigned int code, int length ) {
+        unsigned int reversed = 0 ;
+        for (int i = 0; i < length; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1) ;
+        }
+        PutBits(reversed, length) ;
+    }
+
+    void				Flush				( ) {
+        if (m_Count > 0) {
+            m_Out.push_back(m_Bits & 0xFF) ;
+        }
+        m_Bits = 0 ;
+        m_Count = 0 ;
+    }
+
+  private:
+    std::vector<unsigned char>&	m_Out ;
+    unsigned int		m_Bits ;
+    int					m_Count ;
+};
+
+//////////////////////////////////////////////////////////////////
+
+// the fixed literal/length huffman code
+static void PutLiteral(BitWriter& bits, int symbol) {
+    if (symbol < 144) {
+        bits.PutCode(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        bits.PutCode(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        bits.PutCode(symbol - 256, 7);
+    } else {
+        bits.PutCode(0xC0 + symbol - 280, 8);
+    }
+}
+
+static void PutMatch(BitWriter& bits, int length, int distance) {
+    int code = 28;
+    while (lengthBase[code] > length) {
+        code--;
+    }
+    PutLiteral(bits, 257 + code);
+    bits.PutBits(length - lengthBase[code], lengthExtra[code]);
+
+    code = 29;
+    while (distanceBase[code] > distance) {
+        code--;
+    }
+    bits.PutCode(code, 5);
+    bits.PutBits(distance - distanceBase[code], distanceExtra[code]);
+}
+
+// where the 3 bytes at data go in the match table, nothing to do with the frame hashes
+static int HashMatch(const unsigned char* data) {
+    return ((data[0] << 8) ^ (data[1] << 4) ^ data[2]) & (DEFLATE_HASH_SIZE - 1);
+}
+
+static void PutBigEndian(std::vector<unsigned char>& out, unsigned int value) {
+    out.push_back((value >> 24) & 0xFF);
+    out.push_back((value >> 16) & 0xFF);
+    out.push_back((value >> 8) & 0xFF);
+    out.push_back(value & 0xFF);
+}
+
+//////////////////////////////////////////////////////////////////
+
+ScreenshotWriter::ScreenshotWriter(void) :
+    m_Worker(NULL)
+    ,m_Quit(false)
+    ,m_Slots(NULL)
+    ,m_ScreenshotsWritten(0)
+    ,m_ScreenshotsDropped(0) {
+    m_Slots = new PendingShot[SCREENSHOT_POOL_SIZE];
+    for (int slot = 0; slot < SCREENSHOT_POOL_SIZE; slot++) {
+        m_FreeSlots.Push(slot);
+    }
+
+    for (unsigned int n = 0; n < 256; n++) {
+        unsigned int crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+        }
+        m_CrcTable[n] = crc;
+    }
+
+    m_HashHead.resize(DEFLATE_HASH_SIZE);
+    m_HashPrev.resize(sizeof(m_Rows));
+
+    m_Worker = new std::thread(&ScreenshotWriter::WorkerMain, this);
+}
+
+//////////////////////////////////////////////////////////////////
+
+// anything already captured is still saved
+ScreenshotWriter::~ScreenshotWriter(void) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_WorkReady.notify_one();
+
+    m_Worker->join();
+    delete m_Worker;
+    delete[] m_Slots;
+}
+
+//////////////////////////////////////////////////////////////////
+
+bool ScreenshotWriter::Capture(const Frame& frame, const std::string& fileName) {
+    int slot;
+    if (!m_FreeSlots.Pop(slot)) {
+        m_ScreenshotsDropped++;
+        return false;
+    }
+
+    PendingShot& shot = m_Slots[slot];
+    memcpy(shot.indices, frame.indices, sizeof(frame.indices));
+    memcpy(shot.shades, frame.shades, sizeof(frame.shades));
+    shot.fileName = fileName;
+
+    m_QueuedSlots.Push(slot);
+
+    // taking the lock makes sure the worker is either waiting already or will see the slot before it waits
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+    }
+    m_WorkReady.notify_one();
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenshotWriter::WorkerMain( ) {
+    while (true) {
+        int slot;
+        if (!m_QueuedSlots.Pop(slot)) {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            if (m_Quit && m_QueuedSlots.GetCount() == 0) {
+                break;
+            }
+            m_WorkReady.wait(lock, [this] { return m_Quit || m_QueuedSlots.GetCount() > 0; });
+            continue;
+        }
+
+        if (WritePng(m_Slots[slot])) {
+            m_ScreenshotsWritten.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            std::string message = "Could not save the screenshot " + m_Slots[slot].fileName;
+            LogMessage::GetSingleton()->DoLogMessage(message.c_str(), false);
+        }
+
+        m_FreeSlots.Push(slot);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// the screen only ever has 4 shades so it is saved as a 2 bit palette image
+bool ScreenshotWriter::WritePng(const PendingShot& shot) {
+    for (int line = 0; line < FRAME_HEIGHT; line++) {
+        const unsigned char* indices = &shot.indices[line * FRAME_WIDTH];
+        const unsigned char* shades = shot.shades[line];
+        unsigned char* row = &m_Rows[line * SCREENSHOT_ROW_BYTES];
+
+        // no filter, it rarely helps palette images
+        row[0] = 0;
+        for (int pixel = 0; pixel < FRAME_WIDTH; pixel += 4) {
+            row[1 + pixel / 4] = ((shades[indices[pixel]] & 3) << 6) | ((shades[indices[pixel + 1]] & 3) << 4) |
+                                 ((shades[indices[pixel + 2]] & 3) << 2) | (shades[indices[pixel + 3]] & 3);
+        }
+    }
+
+    m_Png.clear();
+    m_Png.insert(m_Png.end(), pngSignature, pngSignature + sizeof(pngSignature));
+
+    // width, height, 2 bit depth, palette colour, default compression, filter and no interlace
+    unsigned char header[13] = { 0, 0, 0, FRAME_WIDTH, 0, 0, 0, FRAME_HEIGHT, 2, 3, 0, 0, 0 };
+    AddChunk("IHDR", header, sizeof(header));
+
+    unsigned char palette[12];
+    for (int shade = 0; shade < 4; shade++) {
+        const unsigned char* bgra = GetShadeColour(shade);
+        palette[shade * 3] = bgra[2];
+        palette[shade * 3 + 1] = bgra[1];
+        palette[shade * 3 + 2] = bgra[0];
+    }
+    AddChunk("PLTE", palette, sizeof(palette));
+
+    Deflate(m_Rows, sizeof(m_Rows));
+    AddChunk("IDAT", &m_Compressed[0], m_Compressed.size());
+    AddChunk("IEND", NULL, 0);
+
+    FILE* file = fopen(shot.fileName.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool ok = fwrite(&m_Png[0], 1, m_Png.size(), file) == m_Png.size();
+    return fclose(file) == 0 && ok;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// zlib stream holding a single deflate block with the fixed huffman codes, greedy LZ77 matching
+void ScreenshotWriter::Deflate(const unsigned char* data, int size) {
+    assert(size <= (int) m_HashPrev.size());
+
+    m_Compressed.clear();
+
+    // 32K window, no dictionary, fastest compression level
+    m_Compressed.push_back(0x78);
+    m_Compressed.push_back(0x01);
+
+    for (int i = 0; i < DEFLATE_HASH_SIZE; i++) {
+        m_HashHead[i] = -1;
+    }
+
+    BitWriter bits(m_Compressed);
+    bits.PutBits(1, 1);		// last block
+    bits.PutBits(1, 2);		// fixed codes
+
+    int pos = 0;
+    while (pos < size) {
+        int bestLength = 0;
+        int bestDistance = 0;
+
+        if (pos + DEFLATE_MIN_MATCH <= size) {
+            int maxLength = size - pos < DEFLATE_MAX_MATCH ? size - pos : DEFLATE_MAX_MATCH;
+            int candidate = m_HashHead[HashMatch(&data[pos])];
+
+            for (int chain = 0; chain < DEFLATE_MAX_CHAIN && candidate >= 0 && pos - candidate <= DEFLATE_WINDOW; chain++) {
+                int length = 0;
+                while (length < maxLength && data[candidate + length] == data[pos + length]) {
+                    length++;
+                }
+
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = pos - candidate;
+                    if (length == maxLength) {
+                        break;
+                    }
+                }
+
+                candidate = m_HashPrev[candidate];
+            }
+        }
+
+        int advance = 1;
+        if (bestLength >= DEFLATE_MIN_MATCH) {
+            PutMatch(bits, bestLength, bestDistance);
+            advance = bestLength;
+        } else {
+            PutLiteral(bits, data[pos]);
+        }
+
+        // every position gets hashed, including the ones inside the match
+        for (int end = pos + advance; pos < end; pos++) {
+            if (pos + DEFLATE_MIN_MATCH <= size) {
+                int hash = HashMatch(&data[pos]);
+                m_HashPrev[pos] = m_HashHead[hash];
+                m_HashHead[hash] = pos;
+            }
+        }
+    }
+
+    PutLiteral(bits, 256);
+    bits.Flush();
+
+    unsigned int a = 1;
+    unsigned int b = 0;
+    for (int i = 0; i < size; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    PutBigEndian(m_Compressed, (b << 16) | a);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void ScreenshotWriter::AddChunk(const char* type, const unsigned char* data, int size) {
+    PutBigEndian(m_Png, size);
+
+    size_t start = m_Png.size();
+    m_Png.insert(m_Png.end(), type, type + 4);
+    if (size > 0) {
+        m_Png.insert(m_Png.end(), data, data + size);
+    }
+
+    // the crc covers the type and the data
+    unsigned int crc = Crc32(0xFFFFFFFF, &m_Png[start], size + 4) ^ 0xFFFFFFFF;
+    PutBigEndian(m_Png, crc);
+}
+
+//////////////////////////////////////////////////////////////////
+
+unsigned int ScreenshotWriter::Crc32(unsigned int crc, const unsigned char* data, int size) const {
+    for (int i = 0; i < size; i++) {
+        crc = m_CrcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#ifndef _SCREENSHOTWRITER_H
+#define _SCREENSHOTWRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FrameBuffer.h"
+#include "RingBuffer.h"
+
+// how many screenshots can be waiting to be encoded before new ones are dropped
+#define SCREENSHOT_POOL_SIZE 4
+
+// one packed PNG row, the filter byte then 4 pixels to a byte
+#define SCREENSHOT_ROW_BYTES (1 + FRAME_WIDTH / 4)
+
+// saves frames as PNG files on its own thread. Capture only copies the frame into a free pool buffer, the
+// deflate and the file write happen on the worker so taking a screenshot never costs the caller a frame.
+// Capture must always be called from the same thread
+class ScreenshotWriter {
+  public:
+    ScreenshotWriter			(void) ;
+    ~ScreenshotWriter			(void) ;
+
+    // returns false if every pool buffer is still waiting to be encoded
+    bool				Capture				( const Frame& frame, const std::string& fileName ) ;
+
+    unsigned long long	GetScreenshotsWritten	( ) const {
+        return m_ScreenshotsWritten.load(std::memory_order_relaxed) ;
+    }
+    unsigned long long	GetScreenshotsDropped	( ) const {
+        return m_ScreenshotsDropped ;
+    }
+
+  private:
+    struct PendingShot {
+        unsigned char	indices[FRAME_WIDTH * FRAME_HEIGHT] ;
+        unsigned char	shades[FRAME_HEIGHT][FRAME_LINE_SHADES] ;
+        std::string		fileName ;
+    };
+
+    void				WorkerMain			( ) ;
+    bool				WritePng			( const PendingShot& shot ) ;
+    void				Deflate				( const unsigned char* data, int size ) ;
+    void				AddChunk			( const char* type, const unsigned char* data, int size ) ;
+    unsigned int		Crc32				( unsigned int crc, const unsigned char* data, int size ) const ;
+
+    std::thread*		m_Worker ;
+    std::mutex			m_Mutex ;
+    std::condition_variable	m_WorkReady ;
+    bool				m_Quit ;
+
+    // buffer indices go round from m_FreeSlots to m_QueuedSlots and back again
+    PendingShot*		m_Slots ;
+    RingBuffer<int, SCREENSHOT_POOL_SIZE>	m_FreeSlots ;
+    RingBuffer<int, SCREENSHOT_POOL_SIZE>	m_QueuedSlots ;
+
+    // only touched by the worker, kept between screenshots so encoding doesn't allocate
+    unsigned char		m_Rows[FRAME_HEIGHT * SCREENSHOT_ROW_BYTES] ;
+    std::vector<int>	m_HashHead ;
+    std::vector<int>	m_HashPrev ;
+    std::vector<unsigned char>	m_Compressed ;
+    std::vector<unsigned char>	m_Png ;
+    unsigned int		m_CrcTable[256] ;
+
+    std::atomic<unsigned long long>	m_ScreenshotsWritten ;
+    unsigned long long	m_ScreenshotsDropped ;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include "Config.h"
+#include "VideoRecorder.h"
+
+#include <chrono>
+#include <string.h>
+
+// the Game Boy frame rate, 4194304 Hz / 70224 cycles per frame
+#define VIDEO_RATE_NUMERATOR 4194304
+#define VIDEO_RATE_DENOMINATOR 70224
+
+// how long the writer sleeps when there is nothing queued
+#define RECORDER_IDLE_MILLISECONDS 2
+
+// runs shorter than this are cheaper to store as part of a literal
+#define DELTA_MIN_RUN 8
+#define DELTA_MAX_RUN 64
+
+// .gbv delta format. The file starts with
+//   "GBV1", width and height (16 bit), frame rate numerator and denominator (32 bit), BGRA of the 4 shades
+// then each frame is a 32 bit packet size followed by the packet. An empty packet repeats the previous
+// frame, otherwise the packet is a list of tokens that rebuild the shades of every pixel in order starting
+// from the previous frame (all 0 before the first one). The top 2 bits of a token are the type and the low
+// 6 bits are the pixel count - 1
+//   0  skip: the pixels are the same as in the previous frame
+//   1  fill: the pixels are all the shade in the next byte
+//   2  literal: the shades follow, 4 to a byte with the first pixel in the low bits
+// all numbers are little endian
+#define DELTA_SKIP 0
+#define DELTA_FILL 1
+#define DELTA_LITERAL 2
+
+//////////////////////////////////////////////////////////////////
+
+VideoRecorder::VideoRecorder(void) :
+    m_Format(VIDEO_Y4M)
+    ,m_File(NULL)
+    ,m_WriterThread(NULL)
+    ,m_Stopping(false)
+    ,m_WriteFailed(false)
+    ,m_Slots(NULL)
+    ,m_FramesWritten(0)
+    ,m_FramesDropped(0) {
+    m_Slots = new QueuedFrame[RECORDER_QUEUE_FRAMES];
+
+    // every slot starts free and the writer always hands them back, so this only needs doing once
+    for (int slot = 0; slot < RECORDER_QUEUE_FRAMES; slot++) {
+        m_FreeSlots.Push(slot);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+VideoRecorder::~VideoRecorder(void) {
+    Stop( );
+    delete[] m_Slots;
+}
+
+//////////////////////////////////////////////////////////////////
+
+bool VideoRecorder::Start(const std::string& fileName, VIDEO_FORMAT format) {
+    Stop( );
+
+    m_File = fopen(fileName.c_str(), "wb");
+    if (m_File == NULL) {
+        LogMessage::GetSingleton()->DoLogMessage("Could not open the video file for writing", false);
+        return false;
+    }
+
+    m_Format = format;
+    m_WriteFailed = false;
+    m_Stopping.store(false);
+    m_FramesWritten.store(0);
+    m_FramesDropped = 0;
+    memset(m_PreviousShades, 0, sizeof(m_PreviousShades));
+
+    WriteHeader( );
+
+    m_WriterThread = new std::thread(&VideoRecorder::WriterMain, this);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+// everything already queued is still written before the file is closed
+void VideoRecorder::Stop( ) {
+    if (m_WriterThread == NULL) {
+        return;
+    }
+
+    m_Stopping.store(true, std::memory_order_release);
+    m_WriterThread->join();
+    delete m_WriterThread;
+    m_WriterThread = NULL;
+
+    fclose(m_File);
+    m_File = NULL;
+
+    if (m_WriteFailed) {
+        LogMessage::GetSingleton()->DoLogMessage("Writing the video file failed, the recording is incomplete", false);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// returns false if the frame was dropped because every slot is waiting to be written
+bool VideoRecorder::AddFrame(const Frame& frame) {
+    if (!IsRecording()) {
+        return false;
+    }
+
+    int slot;
+    if (!m_FreeSlots.Pop(slot)) {
+        m_FramesDropped++;
+        return false;
+    }
+
+    memcpy(m_Slots[slot].indices, frame.indices, sizeof(frame.indices));
+    memcpy(m_Slots[slot].shades, frame.shades, sizeof(frame.shades));
+
+    // there are only RECORDER_QUEUE_FRAMES slots so this always fits
+    m_QueuedSlots.Push(slot);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void VideoRecorder::WriterMain( ) {
+    while (true) {
+        // anything queued before Stop is visible once m_Stopping is
+        bool stopping = m_Stopping.load(std::memory_order_acquire);
+
+        int slot;
+        if (!m_QueuedSlots.Pop(slot)) {
+            if (stopping) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(RECORDER_IDLE_MILLISECONDS));
+            continue;
+        }
+
+        // the palettes only matter once, every pixel becomes its shade
+        const QueuedFrame& queued = m_Slots[slot];
+        for (int line = 0; line < FRAME_HEIGHT; line++) {
+            const unsigned char* indices = &queued.indices[line * FRAME_WIDTH];
+            unsigned char* shades = &m_Shades[line * FRAME_WIDTH];
+
+            for (int pixel = 0; pixel < FRAME_WIDTH; pixel++) {
+                shades[pixel] = queued.shades[line][indices[pixel]] & 3;
+            }
+        }
+
+        m_FreeSlots.Push(slot);
+
+        if (m_Format == VIDEO_Y4M) {
+            WriteFrameY4M(m_Shades);
+        } else {
+            WriteFrameDelta(m_Shades);
+        }
+
+        m_FramesWritten.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    fflush(m_File);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void VideoRecorder::WriteHeader( ) {
+    if (m_Format == VIDEO_Y4M) {
+        char header[128];
+        sprintf(header, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n", FRAME_WIDTH, FRAME_HEIGHT,
+                VIDEO_RATE_NUMERATOR, VIDEO_RATE_DENOMINATOR);
+        WriteBytes(header, strlen(header));
+        return;
+    }
+
+    unsigned char header[32];
+    int size = 0;
+
+    memcpy(header, "GBV1", 4);
+    size += 4;
+
+    const unsigned int fields[4] = { FRAME_WIDTH, FRAME_HEIGHT, VIDEO_RATE_NUMERATOR, VIDEO_RATE_DENOMINATOR };
+    const int fieldSizes[4] = { 2, 2, 4, 4 };
+    for (int i = 0; i < 4; i++) {
+        for (int byte = 0; byte < fieldSizes[i]; byte++) {
+            header[size++] = (fields[i] >> (byte * 8)) & 0xFF;
+        }
+    }
+
+    WriteBytes(header, size);
+
+    for (int shade = 0; shade < 4; shade++) {
+        WriteBytes(GetShadeColour(shade), 4);
+    }
+}
+
+//////////////////////////////////////////////////////////////////
+
+// full frame in three planes, BT.601 limited range
+void VideoRecorder::WriteFrameY4M(const unsigned char* shades) {
+    const int size = FRAME_WIDTH * FRAME_HEIGHT;
+
+    // only 4 colours, so work them out once
+    unsigned char yuv[4][3];
+    for (int shade = 0; shade < 4; shade++) {
+        const unsigned char* bgra = GetShadeColour(shade);
+        int b = bgra[0], g = bgra[1], r = bgra[2];
+
+        yuv[shade][0] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        yuv[shade][1] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        yuv[shade][2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+
+    for (int pixel = 0; pixel < size; pixel++) {
+        const unsigned char* colour = yuv[shades[pixel]];
+        m_Planes[pixel] = colour[0];
+        m_Planes[size + pixel] = colour[1];
+        m_Planes[size * 2 + pixel] = colour[2];
+    }
+
+    WriteBytes("FRAME\n", 6);
+    WriteBytes(m_Planes, size * 3);
+}
+
+//////////////////////////////////////////////////////////////////
+
+static int CountUnchanged(const unsigned char* shades, const unsigned char* previous, int pos, int total, int limit) {
+    int count = 0;
+    while (pos + count < total && count < limit && shades[pos + count] == previous[pos + count]) {
+        count++;
+    }
+    return count;
+}
+
+static int CountRepeated(const unsigned char* shades, int pos, int total, int limit) {
+    int count = 1;
+    while (pos + count < total && count < limit && shades[pos + count] == shades[pos]) {
+        count++;
+    }
+    return count;
+}
+
+// see the description of the format at the top of the file
+void VideoRecorder::WriteFrameDelta(const unsigned char* shades) {
+    const int total = FRAME_WIDTH * FRAME_HEIGHT;
+    int size = 0;
+
+    if (memcmp(shades, m_PreviousShades, total) != 0) {
+        int pos = 0;
+
+        while (pos < total) {
+            int unchanged = CountUnchanged(shades, m_PreviousShades, pos, total, DELTA_MAX_RUN);
+            if (unchanged >= DELTA_MIN_RUN || (unchanged > 0 && pos + unchanged == total)) {
+                m_Packet[size++] = (DELTA_SKIP << 6) | (unchanged - 1);
+                pos += unchanged;
+                continue;
+            }
+
+            int repeated = CountRepeated(shades, pos, total, DELTA_MAX_RUN);
+            if (repeated >= DELTA_MIN_RUN) {
+                m_Packet[size++] = (DELTA_FILL << 6) | (repeated - 1);
+                m_Packet[size++] = shades[pos];
+                pos += repeated;
+                continue;
+            }
+
+            // a literal carries on until a run worth its own token starts
+            int count = 1;
+            while (pos + count < total && count < DELTA_MAX_RUN &&
+                    CountUnchanged(shades, m_PreviousShades, pos + count, total, DELTA_MIN_RUN) < DELTA_MIN_RUN &&
+                    CountRepeated(shades, pos + count, total, DELTA_MIN_RUN) < DELTA_MIN_RUN) {
+                count++;
+            }
+
+            m_Packet[size++] = (DELTA_LITERAL << 6) | (count - 1);
+            for (int i = 0; i < count; i += 4) {
+                unsigned char packed = 0;
+                for (int j = 0; j < 4 && i + j < count; j++) {
+                    packed |= shades[pos + i + j] << (j * 2);
+                }
+                m_Packet[size++] = packed;
+            }
+            pos += count;
+        }
+
+        memcpy(m_PreviousShades, shades, total);
+    }
+
+    unsigned char header[4];
+    for (int byte = 0; byte < 4; byte++) {
+        header[byte] = (size >> (byte * 8)) & 0xFF;
+    }
+
+    WriteBytes(header, 4);
+    WriteBytes(m_Packet, size);
+}
+
+//////////////////////////////////////////////////////////////////
+
+void VideoRecorder::WriteBytes(const void* data, size_t size) {
+    if (!m_WriteFailed && size > 0 && fwrite(data, 1, size, m_File) != size) {
+        m_WriteFailed = true;
+    }
+}
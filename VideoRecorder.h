@@ -0,0 +1,77 @@
+#pragma once
+#ifndef _VIDEORECORDER_H
+#define _VIDEORECORDER_H
+
+#include <atomic>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+#include "FrameBuffer.h"
+#include "RingBuffer.h"
+
+// how many frames can be waiting for the writer before new ones are dropped
+#define RECORDER_QUEUE_FRAMES 32
+
+enum VIDEO_FORMAT {
+    VIDEO_Y4M,			// uncompressed YUV 4:4:4, plays in most video tools
+    VIDEO_DELTA_RLE		// lossless 2 bit shades, run length coded against the previous frame (see VideoRecorder.cpp)
+};
+
+// streams frames to disk on its own thread. AddFrame only copies the frame into a free slot so the caller
+// never waits on the disk, if the writer falls too far behind the frame is dropped and counted instead
+class VideoRecorder {
+  public:
+    VideoRecorder				(void) ;
+    ~VideoRecorder				(void) ;
+
+    bool				Start				( const std::string& fileName, VIDEO_FORMAT format ) ;
+    void				Stop				( ) ;
+    bool				IsRecording			( ) const {
+        return m_WriterThread != NULL ;
+    }
+
+    bool				AddFrame			( const Frame& frame ) ;
+
+    unsigned long long	GetFramesWritten	( ) const {
+        return m_FramesWritten.load(std::memory_order_relaxed) ;
+    }
+    unsigned long long	GetFramesDropped	( ) const {
+        return m_FramesDropped ;
+    }
+
+  private:
+    // just the parts of a Frame that say what it looks like
+    struct QueuedFrame {
+        unsigned char	indices[FRAME_WIDTH * FRAME_HEIGHT] ;
+        unsigned char	shades[FRAME_HEIGHT][FRAME_LINE_SHADES] ;
+    };
+
+    void				WriterMain			( ) ;
+    void				WriteHeader			( ) ;
+    void				WriteFrameY4M		( const unsigned char* shades ) ;
+    void				WriteFrameDelta		( const unsigned char* shades ) ;
+    void				WriteBytes			( const void* data, size_t size ) ;
+
+    VIDEO_FORMAT		m_Format ;
+    FILE*				m_File ;
+    std::thread*		m_WriterThread ;
+    std::atomic<bool>	m_Stopping ;
+    bool				m_WriteFailed ;
+
+    // slot indices go round from m_FreeSlots to m_QueuedSlots and back again
+    QueuedFrame*		m_Slots ;
+    RingBuffer<int, RECORDER_QUEUE_FRAMES>	m_FreeSlots ;
+    RingBuffer<int, RECORDER_QUEUE_FRAMES>	m_QueuedSlots ;
+
+    // only touched by the writer
+    unsigned char		m_Shades[FRAME_WIDTH * FRAME_HEIGHT] ;
+    unsigned char		m_PreviousShades[FRAME_WIDTH * FRAME_HEIGHT] ;
+    unsigned char		m_Planes[FRAME_WIDTH * FRAME_HEIGHT * 3] ;
+    unsigned char		m_Packet[FRAME_WIDTH * FRAME_HEIGHT * 2] ;
+
+    std::atomic<unsigned long long>	m_FramesWritten ;
+    unsigned long long	m_FramesDropped ;
+};
+
+#endif